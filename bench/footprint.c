@@ -0,0 +1,80 @@
+/**
+ * Reports how much memory the value stack, a constant pool and tables take
+ * with the current Que_Value layout. Build it once normally and once with
+ * -DQUE_NAN_BOXING to compare the two layouts (see `make bench`).
+ */
+#include <stdio.h>
+
+#include <que/state.h>
+
+#include "../src/chunk.h"
+#include "../src/memory.h"
+#include "../src/state_internal.h"
+
+#define STACK_SLOTS (256 * 256)
+#define CONSTANTS 1024
+
+static void report_table(Que_State *state, size_t keys) {
+        Que_TableObject *table = Que_NewTable(state);
+        size_t before = memory_total_allocated();
+        size_t bytes;
+        size_t i;
+        Que_Value tabval;
+
+        /* Reachable, so no collection frees it along the way */
+        Que_ValueTable(&tabval, table);
+        stack_push(state, &tabval);
+
+        for (i = 0; i < keys; i++) {
+                Que_Value key, value;
+
+                Que_ValueInt(&key, (Que_Int)i);
+                Que_ValueFloat(&value, (Que_Float)i);
+                Que_TableInsert(table, &key, &value);
+        }
+
+        bytes = memory_total_allocated() - before;
+        printf("table entries (%7lu keys):  %10lu bytes, %5.1f bytes/entry\n",
+                (unsigned long)keys, (unsigned long)bytes, (double)bytes / keys);
+
+        stack_pop(state);
+}
+
+int main(void) {
+        Que_State *state = Que_NewState();
+        Chunk chunk;
+        size_t before;
+        size_t i;
+
+#ifdef QUE_NAN_BOXING
+        puts("Que_Value layout: NaN-boxed");
+#else
+        puts("Que_Value layout: tagged union");
+#endif
+        printf("sizeof(Que_Value):                %10lu bytes\n",
+                (unsigned long)sizeof(Que_Value));
+        printf("sizeof(Que_TableObject):          %10lu bytes\n",
+                (unsigned long)sizeof(Que_TableObject));
+        printf("value stack (%lu slots):        %10lu bytes\n",
+                (unsigned long)STACK_SLOTS,
+                (unsigned long)(STACK_SLOTS * sizeof(Que_Value)));
+
+        before = memory_total_allocated();
+        chunk_init(state, &chunk);
+        for (i = 0; i < CONSTANTS; i++) {
+                Que_Value v;
+
+                Que_ValueInt(&v, (Que_Int)i);
+                chunk_write_constant(state, &chunk, &v);
+        }
+        printf("constant pool (%d constants):   %10lu bytes\n",
+                CONSTANTS, (unsigned long)(memory_total_allocated() - before));
+        chunk_free(state, &chunk);
+
+        report_table(state, 10);
+        report_table(state, 1000);
+        report_table(state, 100000);
+
+        Que_DeleteState(state);
+        return 0;
+}
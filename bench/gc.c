@@ -0,0 +1,175 @@
+/**
+ * Measures the pauses the garbage collector adds to allocation (see
+ * `make bench`). A state keeps a large set of live tables while a loop keeps
+ * allocating small ones, some of which replace live ones. Every allocation is
+ * timed, and the latencies are reported as a histogram with percentiles, once
+ * with collections running to completion and once for each step size, along
+ * with how full the small object pools are at the end. With a step size set,
+ * no step does much more work than it allows (test/gc_pause.c checks this),
+ * so the max column is down to the system allocator and the scheduler, and
+ * p99.9 is the one to compare between step sizes.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <que/state.h>
+
+#include "../src/state_internal.h"
+
+#define LIVE_TABLES 200000UL
+#define OPERATIONS 2000000UL
+
+/* Latencies are bucketed by powers of two from 1 << HISTOGRAM_MIN ns */
+#define HISTOGRAM_MIN 6
+#define HISTOGRAM_BUCKETS 20
+
+static unsigned long now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+static int compare_ns(const void *a, const void *b) {
+        unsigned long x = *(const unsigned long *)a;
+        unsigned long y = *(const unsigned long *)b;
+
+        return (x > y) - (x < y);
+}
+
+/* A table with an int, a float and a string field, the way scripts use them.
+ * It is kept on the stack while its string is allocated. */
+static Que_TableObject *make_table(Que_State *state, unsigned long i) {
+        Que_TableObject *table = Que_NewTable(state);
+        Que_Value key, value;
+        char buf[32];
+
+        Que_ValueTable(&value, table);
+        *state->stack_top++ = value;
+
+        Que_ValueInt(&key, 0);
+        Que_ValueInt(&value, (Que_Int)i);
+        Que_TableInsert(table, &key, &value);
+
+        Que_ValueInt(&key, 1);
+        Que_ValueFloat(&value, (Que_Float)i);
+        Que_TableInsert(table, &key, &value);
+
+        Que_ValueInt(&key, 2);
+        Que_ValueString(state, &value, buf, sprintf(buf, "item_%lu", i));
+        Que_TableInsert(table, &key, &value);
+
+        state->stack_top--;
+        return table;
+}
+
+static void report(const char *name, unsigned long *samples, unsigned long count, size_t peak) {
+        unsigned long histogram[HISTOGRAM_BUCKETS];
+        unsigned long i;
+        int bucket;
+
+        memset(histogram, 0x00, sizeof(histogram));
+        for (i = 0; i < count; i++) {
+                unsigned long ns = samples[i] >> HISTOGRAM_MIN;
+
+                for (bucket = 0; ns > 0 && bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+                        ns >>= 1;
+                }
+                histogram[bucket]++;
+        }
+
+        qsort(samples, count, sizeof(unsigned long), compare_ns);
+
+        printf("%s: p50 %lu ns, p99 %lu ns, p99.9 %lu ns, max %lu ns, peak heap %lu KB\n",
+                name,
+                samples[count / 2],
+                samples[count / 100 * 99],
+                samples[count / 1000 * 999],
+                samples[count - 1],
+                (unsigned long)peak / 1024);
+
+        for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+                if (histogram[bucket]) {
+                        printf("  < %9lu ns: %8lu\n", 1UL << (HISTOGRAM_MIN + bucket), histogram[bucket]);
+                }
+        }
+}
+
+/* Occupancy of the small object pools once the run is over */
+static void report_pools(Que_State *state) {
+        Que_PoolStats stats[QUE_POOL_CLASSES];
+        unsigned long used = 0, capacity = 0, slabs = 0;
+        int i;
+
+        Que_GetPoolStats(state, stats);
+        for (i = 0; i < QUE_POOL_CLASSES; i++) {
+                used += stats[i].used;
+                capacity += stats[i].capacity;
+                slabs += stats[i].slabs;
+        }
+
+        printf("  pools: %lu of %lu blocks used (%.1f%%) in %lu slabs\n",
+                used, capacity, (capacity) ? 100.0 * used / capacity : 0.0, slabs);
+}
+
+static void bench_gc(const char *name, size_t step) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *live = Que_NewTable(state);
+        unsigned long *samples = malloc(sizeof(unsigned long) * OPERATIONS);
+        size_t peak = 0;
+        Que_Value value;
+        unsigned long i;
+
+        Que_SetGCStepSize(state, step);
+
+        /* The stack is a root, so everything in live stays reachable */
+        Que_ValueTable(&value, live);
+        *state->stack_top++ = value;
+
+        for (i = 0; i < LIVE_TABLES; i++) {
+                Que_Value key;
+
+                Que_ValueInt(&key, (Que_Int)i);
+                Que_ValueTable(&value, make_table(state, i));
+                Que_TableInsert(live, &key, &value);
+        }
+
+        for (i = 0; i < OPERATIONS; i++) {
+                unsigned long start = now_ns();
+                Que_TableObject *table = make_table(state, i);
+
+                /* Every eighth table replaces a live one, the rest die young */
+                if (i % 8 == 0) {
+                        Que_Value key;
+
+                        Que_ValueInt(&key, (Que_Int)((i * 7919) % LIVE_TABLES));
+                        Que_ValueTable(&value, table);
+                        Que_TableInsert(live, &key, &value);
+                }
+
+                samples[i] = now_ns() - start;
+
+                if (state->bytes_allocated > peak) {
+                        peak = state->bytes_allocated;
+                }
+        }
+
+        report(name, samples, OPERATIONS, peak);
+        report_pools(state);
+
+        free(samples);
+        Que_DeleteState(state);
+}
+
+int main(void) {
+        bench_gc("stop the world", 0);
+        bench_gc("step   1024", 1024);
+        bench_gc("step    256", 256);
+        bench_gc("step     64", 64);
+
+        return 0;
+}
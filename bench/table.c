@@ -0,0 +1,265 @@
+/**
+ * Times inserts, hits and misses on tables of 10, 1k and 1M keys (see
+ * `make bench`). Dense int keys 0..n-1 go to a table's array part, sparse int
+ * keys and string keys to its hash part. Each size is repeated so that every
+ * run does about the same number of operations. Tables belong to a state and
+ * are kept on its stack while they are used, the collector frees them after.
+ * Each bench starts with a full collection so that it does not pay for
+ * sweeping the garbage of the one before.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include <stdlib.h>
+
+#include <que/state.h>
+
+#include "../src/gc.h"
+#include "../src/hash.h"
+#include "../src/memory.h"
+#include "../src/state_internal.h"
+
+#define OPERATIONS 4000000UL
+
+typedef enum {
+        KEYS_DENSE,
+        KEYS_SPARSE,
+        KEYS_STRING
+} KeyKind;
+
+static const char *KEY_KIND_NAMES[] = {
+        "dense",
+        "sparse",
+        "string"
+};
+
+static double elapsed_ns(clock_t start, unsigned long operations) {
+        return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / operations;
+}
+
+/* A table that is reachable until drop_table */
+static Que_TableObject *push_table(Que_State *state) {
+        Que_TableObject *table = Que_NewTable(state);
+        Que_Value value;
+
+        Que_ValueTable(&value, table);
+        stack_push(state, &value);
+        return table;
+}
+
+static void drop_table(Que_State *state) {
+        stack_pop(state);
+}
+
+/* String keys are kept alive by inserting them into keep */
+static void make_keys(Que_State *state, Que_TableObject *keep, Que_Value *keys,
+                      unsigned long count, unsigned long offset, KeyKind kind) {
+        unsigned long i;
+
+        for (i = 0; i < count; i++) {
+                switch (kind) {
+                case KEYS_DENSE:
+                        Que_ValueInt(&keys[i], (Que_Int)(i + offset));
+                        break;
+
+                case KEYS_SPARSE:
+                        Que_ValueInt(&keys[i], (Que_Int)(i + offset) * 7919 + 1);
+                        break;
+
+                case KEYS_STRING: {
+                        char buf[32];
+                        int len = sprintf(buf, "key_%lu", i + offset);
+                        Que_ValueString(state, &keys[i], buf, len);
+                        Que_TableInsert(keep, &keys[i], &keys[i]);
+                } break;
+                }
+        }
+}
+
+static void bench_table(Que_State *state, unsigned long count, KeyKind kind) {
+        Que_Value *keys = malloc(sizeof(Que_Value) * count);
+        Que_Value *missing = malloc(sizeof(Que_Value) * count);
+        Que_TableObject *keep = push_table(state);
+        unsigned long rounds = (OPERATIONS / count) ? OPERATIONS / count : 1;
+        unsigned long found = 0;
+        double insert_ns, hit_ns, miss_ns;
+        unsigned long r, i;
+        clock_t start;
+
+        gc_collect(state);
+        make_keys(state, keep, keys, count, 0, kind);
+        make_keys(state, keep, missing, count, count, kind);
+
+        start = clock();
+        for (r = 0; r < rounds; r++) {
+                Que_TableObject *table = push_table(state);
+
+                for (i = 0; i < count; i++) {
+                        Que_TableInsert(table, &keys[i], &keys[i]);
+                }
+
+                drop_table(state);
+        }
+        insert_ns = elapsed_ns(start, rounds * count);
+
+        {
+                Que_TableObject *table = push_table(state);
+
+                for (i = 0; i < count; i++) {
+                        Que_TableInsert(table, &keys[i], &keys[i]);
+                }
+
+                start = clock();
+                for (r = 0; r < rounds; r++) {
+                        for (i = 0; i < count; i++) {
+                                found += Que_TableGet(table, &keys[i]) != NULL;
+                        }
+                }
+                hit_ns = elapsed_ns(start, rounds * count);
+
+                start = clock();
+                for (r = 0; r < rounds; r++) {
+                        for (i = 0; i < count; i++) {
+                                found += Que_TableGet(table, &missing[i]) != NULL;
+                        }
+                }
+                miss_ns = elapsed_ns(start, rounds * count);
+
+                drop_table(state);
+        }
+
+        printf("%-6s keys %8lu: insert %7.1f ns, hit %7.1f ns, miss %7.1f ns%s\n",
+                KEY_KIND_NAMES[kind], count, insert_ns, hit_ns, miss_ns,
+                (found == rounds * count) ? "" : " (lookup mismatch)");
+
+        drop_table(state);
+        free(keys);
+        free(missing);
+}
+
+/* Creates, fills and deletes tables of a few sparse int keys */
+static void bench_tiny(Que_State *state, unsigned long count) {
+        unsigned long rounds = OPERATIONS / count;
+        size_t before;
+        unsigned long r, i;
+        clock_t start;
+
+        gc_collect(state);
+        before = memory_total_allocated();
+
+        start = clock();
+        for (r = 0; r < rounds; r++) {
+                Que_TableObject *table = push_table(state);
+
+                for (i = 0; i < count; i++) {
+                        Que_Value key;
+
+                        Que_ValueInt(&key, (Que_Int)i * 7919 + 1);
+                        Que_TableInsert(table, &key, &key);
+                }
+
+                drop_table(state);
+        }
+
+        printf("tiny   keys %8lu: %7.1f ns, %6.1f bytes per table\n", count,
+                elapsed_ns(start, rounds),
+                (double)(memory_total_allocated() - before) / rounds);
+}
+
+/* Compares filling a table key by key with one bulk insert, then walks it */
+static void bench_bulk(Que_State *state, unsigned long count, KeyKind kind) {
+        Que_Value *keys = malloc(sizeof(Que_Value) * count);
+        Que_TableObject *keep = push_table(state);
+        Que_TableObject *table;
+        Que_TableCursor cursor;
+        Que_Value key, value;
+        double single_ns, bulk_ns, scan_ns;
+        unsigned long seen = 0;
+        unsigned long i;
+        clock_t start;
+
+        gc_collect(state);
+        make_keys(state, keep, keys, count, 0, kind);
+
+        start = clock();
+        table = push_table(state);
+        for (i = 0; i < count; i++) {
+                Que_TableInsert(table, &keys[i], &keys[i]);
+        }
+        single_ns = elapsed_ns(start, count);
+        drop_table(state);
+
+        start = clock();
+        table = push_table(state);
+        Que_TableInsertMany(table, keys, keys, count);
+        bulk_ns = elapsed_ns(start, count);
+
+        start = clock();
+        Que_TableIterate(table, &cursor);
+        while (Que_TableNext(&cursor, &key, &value)) {
+                seen++;
+        }
+        scan_ns = elapsed_ns(start, count);
+        drop_table(state);
+
+        printf("bulk %-6s %8lu: one by one %7.1f ns, bulk %7.1f ns, scan %5.1f ns%s\n",
+                KEY_KIND_NAMES[kind], count, single_ns, bulk_ns, scan_ns,
+                (seen == count) ? "" : " (scan mismatch)");
+
+        drop_table(state);
+        free(keys);
+}
+
+/* Keeps the hash loop from being optimised away */
+static volatile Hash hash_sink;
+
+/* Hashes a buffer of size bytes over and over */
+static void bench_hash(size_t size) {
+        static Que_Byte buffer[4096];
+        unsigned long rounds = OPERATIONS * 4 / (size / 8 + 1);
+        Hash seed = hash_new_seed();
+        Hash sink = 0;
+        double ns;
+        unsigned long r;
+        clock_t start;
+
+        for (r = 0; r < sizeof(buffer); r++) {
+                buffer[r] = (Que_Byte)(r * 31);
+        }
+
+        start = clock();
+        for (r = 0; r < rounds; r++) {
+                buffer[0] = (Que_Byte)r;
+                sink ^= hash_bytes(seed, buffer, size);
+        }
+        ns = elapsed_ns(start, rounds);
+        hash_sink = sink;
+
+        printf("hash   bytes %7lu: %7.1f ns, %5.2f GB/s\n", (unsigned long)size, ns, size / ns);
+}
+
+int main(void) {
+        Que_State *state = Que_NewState();
+        KeyKind kind;
+
+        bench_hash(8);
+        bench_hash(32);
+        bench_hash(256);
+        bench_hash(4096);
+
+        for (kind = KEYS_DENSE; kind <= KEYS_STRING; kind++) {
+                bench_table(state, 10, kind);
+                bench_table(state, 1000, kind);
+                bench_table(state, 1000000, kind);
+        }
+
+        bench_tiny(state, 2);
+        bench_tiny(state, 8);
+        bench_tiny(state, 9);
+
+        bench_bulk(state, 1000000, KEYS_SPARSE);
+        bench_bulk(state, 1000000, KEYS_STRING);
+
+        Que_DeleteState(state);
+        return 0;
+}
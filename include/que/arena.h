@@ -0,0 +1,52 @@
+#ifndef QUE_ARENA_H
+#define QUE_ARENA_H
+
+#include "common.h"
+
+/**
+ * A bump allocator for states that are thrown away as a whole, such as one
+ * state per request. Memory is handed out from large blocks in order and is
+ * only given back when the arena is reset or deleted, except for the most
+ * recent allocation, which is grown, shrunk and freed in place.
+ *
+ *     Que_Arena *arena = Que_NewArena(1024 * 1024);
+ *     Que_State *state = Que_NewStateWithAllocator(Que_ArenaAllocator, arena);
+ *     ...
+ *     Que_ResetArena(arena);
+ *
+ * Resetting or deleting the arena frees the state along with everything in
+ * it, so Que_DeleteState does not need to be called, and the state must not
+ * be used afterwards. Memory the garbage collector frees is not reused until
+ * the arena is reset.
+ */
+typedef struct Que_Arena Que_Arena;
+
+/**
+ * Allocates an arena that gets memory from malloc in blocks of block_size
+ * bytes. Larger allocations get a block of their own. Returns NULL if the
+ * arena could not be allocated.
+ */
+Que_Arena *Que_NewArena(size_t block_size);
+
+/**
+ * Frees every block of the arena, and the arena itself.
+ */
+void Que_DeleteArena(Que_Arena *arena);
+
+/**
+ * Makes all the memory of the arena available again without giving any of it
+ * back to malloc. Takes constant time.
+ */
+void Que_ResetArena(Que_Arena *arena);
+
+/**
+ * Returns the number of bytes handed out since the arena was made or reset.
+ */
+size_t Que_ArenaUsed(Que_Arena *arena);
+
+/**
+ * A Que_Allocator that takes the arena as its userdata.
+ */
+void *Que_ArenaAllocator(void *userdata, void *buf, size_t old_size, size_t new_size);
+
+#endif /* QUE_ARENA_H */
@@ -11,6 +11,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <limits.h>
 
 typedef unsigned char Que_Byte;
 
@@ -25,6 +26,27 @@ typedef unsigned short Que_Word;
 typedef long int Que_Int;
 typedef double Que_Float;
 
+/**
+ * Exactly 64 bits wide, for QUE_NAN_BOXING and the hashes. C89 has no such
+ * type, so one is picked for the platform, and QUE_UINT64_C writes a
+ * constant of it.
+ */
+#if defined(_MSC_VER)
+typedef unsigned __int64 Que_UInt64;
+#        define QUE_UINT64_C(c) c##ui64
+#elif (ULONG_MAX >> 31 >> 31) == 3
+typedef unsigned long int Que_UInt64;
+#        define QUE_UINT64_C(c) c##UL
+#elif defined(__GNUC__)
+__extension__ typedef unsigned long long int Que_UInt64;
+#        define QUE_UINT64_C(c) (__extension__ c##ULL)
+#else
+#        error "No 64 bit type known for this platform, see Que_UInt64"
+#endif
+
+/* Fails to compile if Que_UInt64 is not 64 bits wide */
+typedef char Que_UInt64Check[(sizeof(Que_UInt64) == 8) ? 1 : -1];
+
 #define QUE_TRUE 1
 #define QUE_FALSE 0
 
@@ -38,4 +60,13 @@ typedef double Que_Float;
 #        define QUE_NORETURN
 #endif
 
+/**
+ * The interpreter dispatches instructions with computed gotos on compilers
+ * that support labels as values, and with a switch statement everywhere else.
+ * Define QUE_NO_COMPUTED_GOTO to force the portable switch.
+ */
+#if defined(__GNUC__) && !defined(QUE_NO_COMPUTED_GOTO)
+#        define QUE_COMPUTED_GOTO
+#endif
+
 #endif /* QUE_COMMON_H */
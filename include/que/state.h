@@ -24,15 +24,111 @@ Que_State *Que_NewState(void);
  */
 Que_State *Que_NewStateEx(size_t stack_size, size_t max_recursion);
 
+/**
+ * A function that all the memory of a state comes from. It works like
+ * realloc, except that it is also told the old size of the block. buf is NULL
+ * when old_size is 0. When new_size is 0 the block must be freed and NULL
+ * returned. Otherwise it returns the resized block, or NULL if there is not
+ * enough memory. userdata is the pointer the state was created with.
+ */
+typedef void *(*Que_Allocator)(void *userdata, void *buf, size_t old_size, size_t new_size);
+
+/**
+ * Works in the same way as Que_NewState, but every allocation the state
+ * makes, including the state itself, goes through allocator. See
+ * include/que/arena.h for an allocator that frees a whole state at once.
+ */
+Que_State *Que_NewStateWithAllocator(Que_Allocator allocator, void *userdata);
+
+/**
+ * Instruction sets a state can compile to and execute. QUE_MODE_STACK is the
+ * default. QUE_MODE_REGISTER addresses locals and temporaries directly as
+ * slots of the current call frame, so expressions over locals need fewer
+ * instructions and no pushes or pops.
+ */
+typedef enum {
+        QUE_MODE_STACK,
+        QUE_MODE_REGISTER
+} Que_ExecutionMode;
+
+/**
+ * Selects the instruction set and interpreter loop used by later calls to
+ * Que_ExecuteString. Functions compiled in one mode cannot be called from the
+ * other, so this must be called before any code is executed on the state.
+ */
+void Que_SetExecutionMode(Que_State *state, Que_ExecutionMode mode);
+
+/**
+ * Sets how much work the garbage collector does each time an object is
+ * allocated while a collection is under way. A unit is roughly one value
+ * traced or one object swept. Smaller steps give shorter pauses, but the heap
+ * grows further before a collection finishes. With 0, a collection runs to
+ * completion as soon as it starts.
+ */
+void Que_SetGCStepSize(Que_State *state, size_t work);
+
+/**
+ * Caps the memory a state may hold at bytes, or removes the cap when bytes is
+ * 0, the default. The count covers objects, strings, tables, compiled code and
+ * the state's own bookkeeping, as returned by Que_GetMemoryUsage, but not the
+ * value stack and call frames that are allocated with the state. While a
+ * script runs, an allocation that would go over the limit fails like one the
+ * allocator refuses, see Que_ExecuteString. Calls the host makes outside of
+ * Que_ExecuteString may go over it.
+ */
+void Que_SetMemoryLimit(Que_State *state, size_t bytes);
+
+/**
+ * Returns the bytes that count towards the memory limit of state. Garbage is
+ * included until the collector frees it, and the pools (see Que_PoolStats)
+ * count with every slab they hold, used or not.
+ */
+size_t Que_GetMemoryUsage(Que_State *state);
+
+/**
+ * Small allocations of a state, such as object headers, short strings and the
+ * storage of small tables, come from pools with one size class each. Blocks
+ * are cut from slabs that the state gets from its allocator, and the slabs
+ * of a class are given back once a collection leaves none of its blocks
+ * used. QUE_POOL_CLASSES is the number of size classes.
+ */
+#define QUE_POOL_CLASSES 16
+
+typedef struct {
+        size_t size;     /* Bytes in each block of the class */
+        size_t used;     /* Blocks handed out */
+        size_t capacity; /* Blocks the slabs of the class hold, used or not */
+        size_t slabs;
+} Que_PoolStats;
+
+/**
+ * Fills stats with the occupancy of each pool of state, smallest class first.
+ */
+void Que_GetPoolStats(Que_State *state, Que_PoolStats stats[QUE_POOL_CLASSES]);
+
 /**
  * Must be called when the user is done using the state. Frees any dynamic memory
  * or handles that are associated with it.
  */
 void Que_DeleteState(Que_State *state);
 
+/**
+ * Error codes returned by Que_ExecuteString.
+ */
+#define QUE_ERROR_RUNTIME 1
+#define QUE_ERROR_MEMORY 2
+
 /**
  * Executes the supplied string as Que code. Returns 0 if execution is successful
  * or a non-zero error code otherwise.
+ *
+ * When the state runs out of memory, be it its limit or its allocator, the
+ * script is abandoned wherever it is and QUE_ERROR_MEMORY is returned. Nothing
+ * is printed, reporting it is up to the host. The state can still be used
+ * afterwards, and what the script left behind is
+ * garbage. Changes it made to globals and tables are kept, even one that was
+ * half done. Running out of memory outside of Que_ExecuteString, for instance
+ * in Que_PushString, still exits the process.
  */
 int Que_ExecuteString(Que_State *state, const char *str);
 
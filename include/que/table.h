@@ -5,14 +5,70 @@
 
 typedef struct Que_TableObject Que_TableObject;
 
-Que_TableObject *Que_NewTable(void);
-
-void Que_DeleteTable(Que_TableObject *table);
+/**
+ * Allocates an empty table owned by state. Its entries are allocated from
+ * state as well, and it may only be stored in values of that state.
+ *
+ * Tables are freed by the garbage collector of their state once nothing
+ * reachable refers to them, or by Que_DeleteState, so there is no function
+ * to delete one. A table the host holds on to must be reachable, for
+ * instance through a global (see Que_LoadTable) or the value stack.
+ */
+Que_TableObject *Que_NewTable(struct Que_State *state);
 
 void Que_TableInsert(Que_TableObject *table, Que_Value *key, Que_Value *value);
 
 void Que_TableQInsert(Que_TableObject *table, Que_Value *value, const char *key);
 
+/**
+ * Returns a pointer to the value of key, or NULL if table does not have it.
+ * The pointer is only good until the table is next changed. Store values
+ * with Que_TableInsert rather than through it, which lets the garbage
+ * collector know about them.
+ */
 Que_Value *Que_TableGet(Que_TableObject *table, Que_Value *key);
 
+/**
+ * Makes room for array more consecutive int keys after the last one in the
+ * table, starting from 0, and for hash more keys of any other kind, so that
+ * inserting them does not need to grow the table along the way.
+ */
+void Que_TableReserve(Que_TableObject *table, size_t array, size_t hash);
+
+/**
+ * Inserts count entries, keys[i] mapping to values[i]. Works the same as
+ * calling Que_TableInsert for each one, but sizes the table for all of them
+ * up front.
+ */
+void Que_TableInsertMany(Que_TableObject *table, Que_Value *keys, Que_Value *values, size_t count);
+
+/**
+ * Walks the entries of a table in no particular order. The members are only
+ * meant to be used by table.c.
+ *
+ * Overwriting the value of a key the table already has keeps the cursor
+ * valid. Anything else that changes the table invalidates it: adding a key,
+ * which may grow the array or hash part, move keys from the hash part to the
+ * array part or move string keys out of their shape, as well as
+ * Que_TableReserve and Que_TableInsertMany.
+ */
+typedef struct {
+        Que_TableObject *table;
+        int part;
+        size_t index;
+        void *shape;
+} Que_TableCursor;
+
+/**
+ * Points cursor at the first entry of table.
+ */
+void Que_TableIterate(Que_TableObject *table, Que_TableCursor *cursor);
+
+/**
+ * Copies the key and value of the entry at cursor and moves it to the next
+ * one. Returns QUE_FALSE, leaving key and value untouched, once every entry
+ * has been visited. To change the value, insert it under key again.
+ */
+int Que_TableNext(Que_TableCursor *cursor, Que_Value *key, Que_Value *value);
+
 #endif /* QUE_TABLE_H */
@@ -17,6 +17,68 @@ typedef enum {
 
 typedef struct Que_Object Que_Object;
 
+/**
+ * Que_Value has two layouts which are selected at compile time. Code outside
+ * of this header should only touch a value through the QUE_VALUE_TYPE,
+ * QUE_AS_* and QUE_SET_* macros below, which work with either one.
+ *
+ * By default a value is a type tag followed by a union of the payloads.
+ *
+ * With QUE_NAN_BOXING defined, a value is a single 64-bit word. Floats are
+ * stored as themselves, and every other type is packed into the payload of a
+ * quiet NaN whose top 16 bits select the type. Ints are limited to 48 bits
+ * in this layout, and object pointers must fit in 48 bits, which is the case
+ * on x86-64 and AArch64.
+ */
+#ifdef QUE_NAN_BOXING
+
+typedef union {
+	Que_UInt64 bits;
+	Que_Float f;
+} Que_Value;
+
+#define QUE_NAN_BOX(tag) ((Que_UInt64)(0x7ff8 + (tag)) << 48)
+#define QUE_NAN_PAYLOAD QUE_UINT64_C(0x0000ffffffffffff)
+
+#define QUE_NAN_TAG_NIL 1
+#define QUE_NAN_TAG_CHAR 2
+#define QUE_NAN_TAG_BOOL 3
+#define QUE_NAN_TAG_INT 4
+#define QUE_NAN_TAG_OBJECT 5
+#define QUE_NAN_TAG_CFUNCTION 6
+
+/* Anything outside of the tagged NaN range 0x7ff9..0x7fff is a float */
+#define QUE_NAN_TAG(v) ((int)((v).bits >> 48) - 0x7ff8)
+#define QUE_NAN_IS_BOXED(v) ((Que_UInt64)(((v).bits >> 48) - 0x7ff9) < 7)
+
+#define QUE_VALUE_TYPE(v) \
+	(!QUE_NAN_IS_BOXED(v) ? QUE_TYPE_FLOAT : \
+	 QUE_NAN_TAG(v) == QUE_NAN_TAG_OBJECT ? QUE_AS_OBJECT(v)->type : \
+	 QUE_NAN_TAG(v) == QUE_NAN_TAG_CFUNCTION ? QUE_TYPE_CFUNCTION : \
+	 (Que_Type)(QUE_NAN_TAG(v) - 1))
+
+#define QUE_AS_CHAR(v) ((char)((v).bits & 0xff))
+#define QUE_AS_BOOL(v) ((Que_Byte)((v).bits & 0x1))
+#define QUE_AS_INT(v) (((Que_Int)((v).bits << 16)) >> 16)
+#define QUE_AS_FLOAT(v) ((v).f)
+#define QUE_AS_OBJECT(v) ((Que_Object *)(size_t)((v).bits & QUE_NAN_PAYLOAD))
+#define QUE_AS_CFUNCTION(v) ((Que_CFunction)(size_t)((v).bits & QUE_NAN_PAYLOAD))
+
+#define QUE_SET_NIL(v) ((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_NIL))
+#define QUE_SET_CHAR(v, x) \
+	((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_CHAR) | (Que_UInt64)(unsigned char)(x))
+#define QUE_SET_BOOL(v, x) \
+	((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_BOOL) | (Que_UInt64)((x) != 0))
+#define QUE_SET_INT(v, x) \
+	((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_INT) | ((Que_UInt64)(x) & QUE_NAN_PAYLOAD))
+#define QUE_SET_FLOAT(v, x) ((v).f = (x))
+#define QUE_SET_OBJECT(v, t, x) \
+	((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_OBJECT) | (Que_UInt64)(size_t)(x))
+#define QUE_SET_CFUNCTION(v, x) \
+	((v).bits = QUE_NAN_BOX(QUE_NAN_TAG_CFUNCTION) | (Que_UInt64)(size_t)(x))
+
+#else
+
 typedef struct {
 	Que_Type type;
 
@@ -29,6 +91,25 @@ typedef struct {
 	} value;
 } Que_Value;
 
+#define QUE_VALUE_TYPE(v) ((v).type)
+
+#define QUE_AS_CHAR(v) ((v).value.c)
+#define QUE_AS_BOOL(v) ((v).value.b)
+#define QUE_AS_INT(v) ((v).value.i)
+#define QUE_AS_FLOAT(v) ((v).value.f)
+#define QUE_AS_OBJECT(v) ((v).value.o)
+#define QUE_AS_CFUNCTION(v) ((Que_CFunction)(v).value.o)
+
+#define QUE_SET_NIL(v) ((v).type = QUE_TYPE_NIL, (v).value.o = NULL)
+#define QUE_SET_CHAR(v, x) ((v).type = QUE_TYPE_CHAR, (v).value.c = (x))
+#define QUE_SET_BOOL(v, x) ((v).type = QUE_TYPE_BOOL, (v).value.b = (x))
+#define QUE_SET_INT(v, x) ((v).type = QUE_TYPE_INT, (v).value.i = (x))
+#define QUE_SET_FLOAT(v, x) ((v).type = QUE_TYPE_FLOAT, (v).value.f = (x))
+#define QUE_SET_OBJECT(v, t, x) ((v).type = (t), (v).value.o = (Que_Object *)(x))
+#define QUE_SET_CFUNCTION(v, x) ((v).type = QUE_TYPE_CFUNCTION, (v).value.o = (Que_Object *)(x))
+
+#endif /* QUE_NAN_BOXING */
+
 struct Que_Object {
 	Que_Type type;
 	Que_Object *next;
@@ -37,25 +118,61 @@ struct Que_Object {
 
 #define QUE_OBJECT_HEAD Que_Object ob_head
 
+struct Que_State;
 
-Que_Object *allocate_obj(size_t size, Que_Type type);
-
-void free_obj(Que_Object *obj);
-
+/**
+ * Objects belong to the state they are allocated for, whose memory they
+ * count towards and whose collector frees them. They must only be stored
+ * into values of that same state.
+ */
+Que_Object *allocate_obj(struct Que_State *state, size_t size, Que_Type type);
+
+void free_obj(struct Que_State *state, Que_Object *obj);
+
+/**
+ * hash is worked out once when the string is created. Interned strings are
+ * owned by the intern set of a Que_State, which holds at most one string with
+ * any given contents, so two interned strings are equal only if they are the
+ * same object.
+ *
+ * The characters are stored right after the other fields, in the same
+ * allocation, and are followed by a '\0'. str is declared with one element
+ * since C89 has no flexible array members.
+ *
+ * A string with rope set is the result of a concatenation that has not been
+ * copied into one buffer yet. It has no characters or hash of its own until
+ * string_flatten is called on it, so anything that reads those has to go
+ * through string_flatten first.
+ */
 typedef struct {
 	QUE_OBJECT_HEAD;
 
+	Que_UInt64 hash;
 	size_t length;
-	char *str;
+	Que_Byte interned;
+	Que_Byte rope;
+	char str[1];
 } Que_StringObject;
 
-Que_StringObject *allocate_string(const char *str, size_t length);
+Que_StringObject *allocate_string(struct Que_State *state, const char *str, size_t length);
+
+/**
+ * Returns a string holding a followed by b. Long results only refer to their
+ * two halves, so appending to a string over and over takes time linear in
+ * the final length. May collect, so a and b must be reachable.
+ */
+Que_StringObject *string_concat(struct Que_State *state, Que_StringObject *a, Que_StringObject *b);
+
+/**
+ * Returns str itself, or for a rope the flat string with the same contents.
+ * The copy is made once and kept alive by the rope. Never collects.
+ */
+Que_StringObject *string_flatten(struct Que_State *state, Que_StringObject *str);
 
 typedef struct Que_FunctionObject Que_FunctionObject;
 
-Que_FunctionObject *allocate_function(Que_Value *identifier);
+Que_FunctionObject *allocate_function(struct Que_State *state, Que_Value *identifier);
 
-struct Que_State;
 typedef int (*Que_CFunction) (struct Que_State *, int);
 
 void Que_ValueCFunction(Que_Value *val, Que_CFunction callback);
@@ -67,7 +184,7 @@ void Que_ValueChar(Que_Value *val, char c);
 void Que_ValueBool(Que_Value *val, int b);
 void Que_ValueInt(Que_Value *val, Que_Int i);
 void Que_ValueFloat(Que_Value *val, Que_Float f);
-void Que_ValueString(Que_Value *val, const char *str, size_t len);
+void Que_ValueString(struct Que_State *state, Que_Value *val, const char *str, size_t len);
 void Que_ValueTable(Que_Value *val, struct Que_TableObject *table);
 void Que_ValueFunction(Que_Value *val, Que_FunctionObject *func);
 
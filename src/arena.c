@@ -0,0 +1,160 @@
+#include <que/arena.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Every allocation is aligned for the strictest of these */
+typedef union {
+        long l;
+        double d;
+        void *p;
+} ArenaAlign;
+
+#define ALIGN_UP(size) (((size) + sizeof(ArenaAlign) - 1) / sizeof(ArenaAlign) * sizeof(ArenaAlign))
+
+/* Memory of a block starts right after its header */
+#define BLOCK_DATA(block) ((char *)(block) + ALIGN_UP(sizeof(ArenaBlock)))
+
+typedef struct ArenaBlock {
+        struct ArenaBlock *next;
+        size_t size;
+        size_t used;
+} ArenaBlock;
+
+/**
+ * Blocks are used in list order. After a reset, the blocks after current still
+ * hold their old used counts, which are cleared as they are reached again.
+ */
+struct Que_Arena {
+        ArenaBlock *first;
+        ArenaBlock *current;
+        size_t block_size;
+        size_t used;
+
+        /* The most recent allocation, at the end of current */
+        char *last;
+};
+
+static ArenaBlock *new_block(size_t size) {
+        ArenaBlock *block = malloc(ALIGN_UP(sizeof(ArenaBlock)) + size);
+
+        if (!block) {
+                return NULL;
+        }
+
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+
+        return block;
+}
+
+Que_Arena *Que_NewArena(size_t block_size) {
+        Que_Arena *arena = malloc(sizeof(Que_Arena));
+
+        if (!arena) {
+                return NULL;
+        }
+
+        arena->block_size = ALIGN_UP(block_size);
+        arena->first = new_block(arena->block_size);
+        if (!arena->first) {
+                free(arena);
+                return NULL;
+        }
+
+        arena->current = arena->first;
+        arena->used = 0;
+        arena->last = NULL;
+
+        return arena;
+}
+
+void Que_DeleteArena(Que_Arena *arena) {
+        ArenaBlock *block = arena->first;
+
+        while (block) {
+                ArenaBlock *next = block->next;
+
+                free(block);
+                block = next;
+        }
+
+        free(arena);
+}
+
+void Que_ResetArena(Que_Arena *arena) {
+        arena->current = arena->first;
+        arena->current->used = 0;
+        arena->used = 0;
+        arena->last = NULL;
+}
+
+size_t Que_ArenaUsed(Que_Arena *arena) {
+        return arena->used;
+}
+
+static void *arena_alloc(Que_Arena *arena, size_t size) {
+        ArenaBlock *block = arena->current;
+
+        size = ALIGN_UP(size);
+
+        while (block->used + size > block->size) {
+                if (block->next && block->next->size >= size) {
+                        block = block->next;
+                        block->used = 0;
+                } else {
+                        ArenaBlock *fresh = new_block((size > arena->block_size) ? size : arena->block_size);
+
+                        if (!fresh) {
+                                return NULL;
+                        }
+
+                        fresh->next = block->next;
+                        block->next = fresh;
+                        block = fresh;
+                }
+        }
+
+        arena->current = block;
+        arena->last = BLOCK_DATA(block) + block->used;
+        block->used += size;
+        arena->used += size;
+
+        return arena->last;
+}
+
+void *Que_ArenaAllocator(void *userdata, void *buf, size_t old_size, size_t new_size) {
+        Que_Arena *arena = userdata;
+        void *result;
+
+        if (buf && buf == arena->last) {
+                ArenaBlock *block = arena->current;
+                size_t start = arena->last - BLOCK_DATA(block);
+
+                if (start + ALIGN_UP(new_size) <= block->size) {
+                        arena->used = arena->used - (block->used - start) + ALIGN_UP(new_size);
+                        block->used = start + ALIGN_UP(new_size);
+
+                        if (new_size == 0) {
+                                arena->last = NULL;
+                                return NULL;
+                        }
+
+                        return buf;
+                }
+        }
+
+        if (new_size == 0) {
+                return NULL;
+        } else if (buf && new_size <= old_size) {
+                return buf;
+        }
+
+        result = arena_alloc(arena, new_size);
+        if (result && buf) {
+                memcpy(result, buf, old_size);
+        }
+
+        return result;
+}
@@ -1,7 +1,9 @@
 #include "chunk.h"
 
+#include "hash.h"
 #include "memory.h"
 #include "opcodes.h"
+#include "state_internal.h"
 #include <que/value.h>
 
 #include <stdio.h>
@@ -10,26 +12,65 @@
 #define CODE_INIT_SIZE 64
 #define CONSTANTS_INIT_SIZE 16
 
-void chunk_init(Chunk *chunk) {
-        chunk->code = ALLOCATE(chunk->code, CODE_INIT_SIZE);
-        chunk->code_allocated = CODE_INIT_SIZE;
+/* The constant map is kept at most half full */
+#define CONSTANT_MAP_INIT_SIZE 32
+
+/* Marks an empty slot of the constant map */
+#define CONSTANT_MAP_EMPTY QUE_WORD_MAX
+
+void chunk_init(Que_State *state, Chunk *chunk) {
+        /* The chunk must be safe to free if one of the allocations fails */
+        chunk->code = NULL;
+        chunk->code_allocated = 0;
         chunk->code_size = 0;
+        chunk->constants = NULL;
+        chunk->constants_allocated = 0;
+        chunk->constants_size = 0;
+        chunk->caches = NULL;
+        chunk->caches_allocated = 0;
+        chunk->constant_map = NULL;
+        chunk->constant_map_capacity = 0;
 
-        chunk->constants = ALLOCATE(chunk->constants, sizeof(Que_Value) * CONSTANTS_INIT_SIZE);
+        chunk->code = ALLOCATE(state, NULL, CODE_INIT_SIZE);
+        chunk->code_allocated = CODE_INIT_SIZE;
+
+        chunk->constants = ALLOCATE(state, NULL, sizeof(Que_Value) * CONSTANTS_INIT_SIZE);
         chunk->constants_allocated = CONSTANTS_INIT_SIZE;
-        chunk->constants_size = 0;
 
         memset(chunk->constants, 0xAA, chunk->constants_allocated);
+
+        chunk->caches = ALLOCATE(state, NULL, sizeof(InlineCache) * CONSTANTS_INIT_SIZE);
+        chunk->caches_allocated = CONSTANTS_INIT_SIZE;
 }
 
-void chunk_free(Chunk *chunk) {
-        FREE(chunk->code, chunk->code_allocated);
-        FREE(chunk->constants, chunk->constants_allocated);
+void chunk_free(Que_State *state, Chunk *chunk) {
+        if (chunk->code) {
+                FREE(state, chunk->code, chunk->code_allocated);
+        }
+
+        if (chunk->constants) {
+                FREE(state, chunk->constants, sizeof(Que_Value) * chunk->constants_allocated);
+        }
+
+        if (chunk->caches) {
+                FREE(state, chunk->caches, sizeof(InlineCache) * chunk->caches_allocated);
+        }
+
+        chunk_finish(state, chunk);
+}
+
+void chunk_finish(Que_State *state, Chunk *chunk) {
+        if (chunk->constant_map) {
+                chunk->constant_map = FREE(state, chunk->constant_map, sizeof(Que_Word) * chunk->constant_map_capacity);
+        }
+
+        chunk->constant_map_capacity = 0;
 }
 
-void chunk_write_byte(Chunk *chunk, Que_Byte b) {
+void chunk_write_byte(Que_State *state, Chunk *chunk, Que_Byte b) {
         if (chunk->code_size + 1 > chunk->code_allocated) {
                 chunk->code = ARRAY_GROW(
+                        state,
                         chunk->code, 
                         chunk->code_allocated, 
                         chunk->code_allocated * 2
@@ -40,39 +81,266 @@ void chunk_write_byte(Chunk *chunk, Que_Byte b) {
         chunk->code[chunk->code_size++] = b;
 }
 
-void chunk_write_word(Chunk *chunk, Que_Word w) {
-        chunk_write_byte(chunk, w >> 8);
-        chunk_write_byte(chunk, w & 0x00ff);
+void chunk_write_word(Que_State *state, Chunk *chunk, Que_Word w) {
+        chunk_write_byte(state, chunk, w >> 8);
+        chunk_write_byte(state, chunk, w & 0x00ff);
 }
 
-Que_Word chunk_write_constant(Chunk *chunk, Que_Value *v) {
+void chunk_write_instruction(Que_State *state, Chunk *chunk, Que_Byte op, Que_Word arg) {
+        switch (OPCODE_ARGS[op]) {
+        case OPCODE_ARG_NONE:
+                chunk_write_byte(state, chunk, op);
+                break;
+
+        case OPCODE_ARG_BYTE:
+                if (arg > QUE_BYTE_MAX) {
+                        chunk_write_byte(state, chunk, OP_WIDE);
+                        chunk_write_byte(state, chunk, op);
+                        chunk_write_word(state, chunk, arg);
+                } else {
+                        chunk_write_byte(state, chunk, op);
+                        chunk_write_byte(state, chunk, (Que_Byte)arg);
+                }
+                break;
+
+        case OPCODE_ARG_BYTE2:
+                chunk_write_byte(state, chunk, op);
+                chunk_write_byte(state, chunk, arg >> 8);
+                chunk_write_byte(state, chunk, arg & 0x00ff);
+                break;
+
+        case OPCODE_ARG_WORD:
+                chunk_write_byte(state, chunk, op);
+                chunk_write_word(state, chunk, arg);
+                break;
+        }
+}
+
+static Hash constant_hash(Que_State *state, Que_Value *v) {
+        Hash hash;
+
+        switch (QUE_VALUE_TYPE(*v)) {
+        case QUE_TYPE_NIL:
+                hash = 0;
+                break;
+
+        case QUE_TYPE_CHAR:
+                hash = (Hash)(unsigned char)QUE_AS_CHAR(*v);
+                break;
+
+        case QUE_TYPE_BOOL:
+                hash = (Hash)QUE_AS_BOOL(*v);
+                break;
+
+        case QUE_TYPE_INT:
+                hash = (Hash)QUE_AS_INT(*v);
+                break;
+
+        case QUE_TYPE_FLOAT: {
+                Que_Float f = QUE_AS_FLOAT(*v);
+
+                memcpy(&hash, &f, sizeof(hash));
+        } break;
+
+        case QUE_TYPE_STRING:
+                return ((Que_StringObject *)QUE_AS_OBJECT(*v))->hash;
+
+        case QUE_TYPE_CFUNCTION: {
+                Que_CFunction func = QUE_AS_CFUNCTION(*v);
+
+                return hash_bytes(state->hash_seed, &func, sizeof(func));
+        }
+
+        default:
+                hash = (Hash)(size_t)QUE_AS_OBJECT(*v);
+                break;
+        }
+
+        return hash_int(state->hash_seed, hash + QUE_VALUE_TYPE(*v));
+}
+
+static int constants_equal(Que_Value *a, Que_Value *b) {
+        if (QUE_VALUE_TYPE(*a) != QUE_VALUE_TYPE(*b)) {
+                return QUE_FALSE;
+        }
+
+        switch (QUE_VALUE_TYPE(*a)) {
+        case QUE_TYPE_NIL:
+                return QUE_TRUE;
+
+        case QUE_TYPE_CHAR:
+                return QUE_AS_CHAR(*a) == QUE_AS_CHAR(*b);
+
+        case QUE_TYPE_BOOL:
+                return QUE_AS_BOOL(*a) == QUE_AS_BOOL(*b);
+
+        case QUE_TYPE_INT:
+                return QUE_AS_INT(*a) == QUE_AS_INT(*b);
+
+        /* 0.0 and -0.0 compare equal but are different constants */
+        case QUE_TYPE_FLOAT: {
+                Que_Float fa = QUE_AS_FLOAT(*a);
+                Que_Float fb = QUE_AS_FLOAT(*b);
+
+                return memcmp(&fa, &fb, sizeof(Que_Float)) == 0;
+        }
+
+        case QUE_TYPE_STRING: {
+                Que_StringObject *sa = (Que_StringObject *)QUE_AS_OBJECT(*a);
+                Que_StringObject *sb = (Que_StringObject *)QUE_AS_OBJECT(*b);
+
+                return sa == sb || (sa->hash == sb->hash && sa->length == sb->length &&
+                        memcmp(sa->str, sb->str, sa->length) == 0);
+        }
+
+        case QUE_TYPE_CFUNCTION:
+                return QUE_AS_CFUNCTION(*a) == QUE_AS_CFUNCTION(*b);
+
+        default:
+                return QUE_AS_OBJECT(*a) == QUE_AS_OBJECT(*b);
+        }
+}
+
+/* Returns the slot of the constant map holding a constant equal to v, or the
+ * empty slot where it would go */
+static size_t constant_map_find(Que_State *state, Chunk *chunk, Que_Value *v) {
+        size_t mask = chunk->constant_map_capacity - 1;
+        size_t index = (size_t)(constant_hash(state, v) & mask);
+
+        while (chunk->constant_map[index] != CONSTANT_MAP_EMPTY &&
+               !constants_equal(&chunk->constants[chunk->constant_map[index]], v)) {
+                index = (index + 1) & mask;
+        }
+
+        return index;
+}
+
+static void constant_map_grow(Que_State *state, Chunk *chunk) {
+        size_t capacity = (chunk->constant_map_capacity) ? chunk->constant_map_capacity * 2 : CONSTANT_MAP_INIT_SIZE;
+        Que_Word *map = ALLOCATE(state, NULL, sizeof(Que_Word) * capacity);
+        size_t i;
+
+        memset(map, 0xFF, sizeof(Que_Word) * capacity);
+
+        chunk_finish(state, chunk);
+        chunk->constant_map = map;
+        chunk->constant_map_capacity = capacity;
+
+        for (i = 0; i < chunk->constants_size && i < CONSTANT_MAP_EMPTY; i++) {
+                map[constant_map_find(state, chunk, &chunk->constants[i])] = (Que_Word)i;
+        }
+}
+
+Que_Word chunk_write_constant(Que_State *state, Chunk *chunk, Que_Value *v) {
         Que_Value val = *v;
+        size_t slot;
+
+        if ((chunk->constants_size + 1) * 2 > chunk->constant_map_capacity) {
+                constant_map_grow(state, chunk);
+        }
+
+        slot = constant_map_find(state, chunk, &val);
+        if (chunk->constant_map[slot] != CONSTANT_MAP_EMPTY) {
+                return chunk->constant_map[slot];
+        }
+
         if (chunk->constants_size + 1 > chunk->constants_allocated) {
                 chunk->constants = ARRAY_GROW(
+                        state,
                         chunk->constants,
-                        chunk->constants_allocated,
-                        chunk->constants_allocated * 2
+                        sizeof(Que_Value) * chunk->constants_allocated,
+                        sizeof(Que_Value) * chunk->constants_allocated * 2
                 );
                 chunk->constants_allocated *= 2;
         }
 
+        if (chunk->constants_size + 1 > chunk->caches_allocated) {
+                chunk->caches = ARRAY_GROW(
+                        state,
+                        chunk->caches,
+                        sizeof(InlineCache) * chunk->caches_allocated,
+                        sizeof(InlineCache) * chunk->constants_allocated
+                );
+                chunk->caches_allocated = chunk->constants_allocated;
+        }
+
+        chunk->caches[chunk->constants_size].shape = NULL;
+        chunk->caches[chunk->constants_size].table = NULL;
         chunk->constants[chunk->constants_size++] = val;
 
+        if (chunk->constants_size - 1 < CONSTANT_MAP_EMPTY) {
+                chunk->constant_map[slot] = (Que_Word)(chunk->constants_size - 1);
+        }
+
         return (Que_Word)(chunk->constants_size - 1);
 }
 
 void chunk_disassemble(const Chunk *chunk) {
         size_t i;
 
-        for (i = 0; i < chunk->code_size; i++) {
-                Que_Byte op = chunk->code[i];
+        for (i = 0; i < chunk->code_size; i += INSTRUCTION_SIZE(&chunk->code[i])) {
+                const Que_Byte *code = &chunk->code[i];
 
-                if (OPCODE_HAS_ARG[op]) {
-                        Que_Word word = (chunk->code[i + 1] << 8) + chunk->code[i + 2];
-                        printf("%04zu: %s, %d\n", i, OPCODE_NAMES[op], word);
-                        i += 2;
-                } else {
-                        printf("%04zu: %s\n", i, OPCODE_NAMES[op]);
+                if (code[0] == OP_WIDE) {
+                        Que_Word word = (code[2] << 8) + code[3];
+                        printf("%04zu: %s, %d (wide)\n", i, OPCODE_NAMES[code[1]], word);
+                        continue;
+                }
+
+                switch (OPCODE_ARGS[code[0]]) {
+                case OPCODE_ARG_NONE:
+                        printf("%04zu: %s\n", i, OPCODE_NAMES[code[0]]);
+                        break;
+
+                case OPCODE_ARG_BYTE:
+                        printf("%04zu: %s, %d\n", i, OPCODE_NAMES[code[0]], code[1]);
+                        break;
+
+                case OPCODE_ARG_BYTE2:
+                        printf("%04zu: %s, %d, %d\n", i, OPCODE_NAMES[code[0]], code[1], code[2]);
+                        break;
+
+                case OPCODE_ARG_WORD: {
+                        Que_Word word = (code[1] << 8) + code[2];
+                        printf("%04zu: %s, %d\n", i, OPCODE_NAMES[code[0]], word);
+                } break;
+                }
+        }
+}
+
+void chunk_disassemble_registers(const Chunk *chunk) {
+        size_t i;
+
+        for (i = 0; i < chunk->code_size; i += ROPCODE_SIZES[chunk->code[i]]) {
+                const Que_Byte *code = &chunk->code[i];
+
+                switch (ROPCODE_ARGS[code[0]]) {
+                case ROPCODE_ARG_A:
+                        printf("%04zu: %s, r%d\n", i, ROPCODE_NAMES[code[0]], code[1]);
+                        break;
+
+                case ROPCODE_ARG_AB:
+                        printf("%04zu: %s, r%d, r%d\n", i, ROPCODE_NAMES[code[0]], code[1], code[2]);
+                        break;
+
+                case ROPCODE_ARG_ABC:
+                        printf("%04zu: %s, r%d, r%d, r%d\n", i, ROPCODE_NAMES[code[0]], code[1], code[2], code[3]);
+                        break;
+
+                case ROPCODE_ARG_AK: {
+                        Que_Word word = (code[2] << 8) + code[3];
+                        printf("%04zu: %s, r%d, k%d\n", i, ROPCODE_NAMES[code[0]], code[1], word);
+                } break;
+
+                case ROPCODE_ARG_ABK: {
+                        Que_Word word = (code[3] << 8) + code[4];
+                        printf("%04zu: %s, r%d, r%d, k%d\n", i, ROPCODE_NAMES[code[0]], code[1], code[2], word);
+                } break;
+
+                case ROPCODE_ARG_AG: {
+                        Que_Word word = (code[2] << 8) + code[3];
+                        printf("%04zu: %s, r%d, g%d\n", i, ROPCODE_NAMES[code[0]], code[1], word);
+                } break;
                 }
         }
 }
@@ -2,8 +2,25 @@
 #define QUE_CHUNK_H
 
 #include <que/common.h>
+#include <que/state.h>
+#include <que/table.h>
 #include <que/value.h>
 
+/**
+ * Remembers where the last table lookup keyed by a constant found its value.
+ * A field found through a table's shape is at the same offset in any table
+ * with that shape. Otherwise the result can be reused without hashing the key
+ * again while the lookup is on the same table and its version is unchanged.
+ */
+typedef struct {
+        struct Shape *shape;
+        size_t index;
+
+        Que_TableObject *table;
+        unsigned long version;
+        Que_Value *value;
+} InlineCache;
+
 typedef struct {
         size_t code_allocated;
         size_t code_size;
@@ -12,18 +29,55 @@ typedef struct {
         size_t constants_allocated;
         size_t constants_size;
         Que_Value *constants;
+
+        /* One per constant, used by the instructions that look it up as a key.
+         * Grown apart from constants, see reallocate */
+        InlineCache *caches;
+        size_t caches_allocated;
+
+        /* Open addressing set of constant indices, so that equal constants
+         * are only added once. Only kept while the chunk is written, see
+         * chunk_finish */
+        Que_Word *constant_map;
+        size_t constant_map_capacity;
 } Chunk;
 
-void chunk_init(Chunk *chunk);
+void chunk_init(Que_State *state, Chunk *chunk);
+
+void chunk_free(Que_State *state, Chunk *chunk);
 
-void chunk_free(Chunk *chunk);
+void chunk_write_byte(Que_State *state, Chunk *chunk, Que_Byte b);
 
-void chunk_write_byte(Chunk *chunk, Que_Byte b);
+void chunk_write_word(Que_State *state, Chunk *chunk, Que_Word w);
 
-void chunk_write_word(Chunk *chunk, Que_Word w);
+/**
+ * Writes op followed by its argument in the encoding opcodes.txt declares for
+ * it, adding an OP_WIDE prefix when needed. For OP_BYTE2 instructions the
+ * first argument is the upper byte of arg and the second the lower byte. arg
+ * is ignored for opcodes without one.
+ */
+void chunk_write_instruction(Que_State *state, Chunk *chunk, Que_Byte op, Que_Word arg);
 
-Que_Word chunk_write_constant(Chunk *chunk, Que_Value *v);
+/**
+ * Returns the index of a constant equal to v, adding v if there is none yet.
+ * Constants are equal if they have the same type and value, strings if they
+ * have the same contents and floats if they have the same bits. Instructions
+ * using the same constant share its inline cache.
+ */
+Que_Word chunk_write_constant(Que_State *state, Chunk *chunk, Que_Value *v);
+
+/**
+ * Frees what the chunk only needs while it is being written. No constants
+ * may be added afterwards.
+ */
+void chunk_finish(Que_State *state, Chunk *chunk);
 
 void chunk_disassemble(const Chunk *chunk);
 
+/**
+ * Same as chunk_disassemble, for chunks holding the register instruction set
+ * from ropcodes.txt.
+ */
+void chunk_disassemble_registers(const Chunk *chunk);
+
 #endif /* QUE_CHUNK_H */
@@ -0,0 +1,425 @@
+#include "gc.h"
+
+#include "memory.h"
+#include "state_internal.h"
+#include "table_internal.h"
+
+#include <string.h>
+
+/* Collect once the state holds this many bytes, at the least */
+#define GC_MIN_THRESHOLD (1024 * 1024)
+
+/* The next collection is due once the heap has grown by this factor */
+#define GC_GROWTH 2
+
+/* Units of work done per object allocated while a collection runs */
+#define GC_STEP_SIZE 256
+
+#define GRAY_INIT_SIZE 64
+
+/* Collections are finished at once within 1/GC_LIMIT_MARGIN of the memory
+ * limit, since allocations could start failing before a step frees anything */
+#define GC_LIMIT_MARGIN 8
+
+void gc_init(Que_State *state) {
+        state->objects = NULL;
+        state->bytes_allocated = 0;
+        state->next_gc = GC_MIN_THRESHOLD;
+        state->gc_requested = QUE_FALSE;
+        state->gc_mark = QUE_FALSE;
+        state->gc_phase = GC_PHASE_IDLE;
+        state->gc_paused = 0;
+        state->gc_step_size = GC_STEP_SIZE;
+        state->gc_sweep = NULL;
+        state->gc_cursor.table = NULL;
+        state->gray = NULL;
+        state->gray_count = 0;
+        state->gray_allocated = 0;
+}
+
+void gc_account(Que_State *state, size_t old_size, size_t new_size) {
+        if (new_size > old_size) {
+                state->bytes_allocated += new_size - old_size;
+
+                /* Collecting here could trace or free objects that are half
+                 * built, so only ask for it and let gc_track do the work. */
+                if (state->gc_phase == GC_PHASE_IDLE && state->bytes_allocated > state->next_gc) {
+                        state->gc_requested = QUE_TRUE;
+                }
+        } else {
+                size_t freed = old_size - new_size;
+
+                state->bytes_allocated -= (freed < state->bytes_allocated) ? freed : state->bytes_allocated;
+        }
+}
+
+void gc_track(Que_State *state, Que_Object *obj) {
+        if (state->gc_paused == 0) {
+#ifdef QUE_DEBUG_STRESS_GC
+                gc_collect(state);
+#else
+                if (state->gc_requested || state->gc_phase != GC_PHASE_IDLE) {
+                        gc_step(state);
+                }
+#endif
+        }
+
+        obj->marked = state->gc_mark;
+        obj->next = state->objects;
+        state->objects = obj;
+}
+
+void gc_pause(Que_State *state) {
+        state->gc_paused++;
+}
+
+void gc_resume(Que_State *state) {
+        assert(state->gc_paused > 0);
+        state->gc_paused--;
+}
+
+static void mark_object(Que_State *state, Que_Object *obj) {
+        if (!obj || obj->marked == state->gc_mark) {
+                return;
+        }
+
+        obj->marked = state->gc_mark;
+
+        /* Flat strings refer to nothing, so there is no need to visit them
+         * again */
+        if (obj->type == QUE_TYPE_STRING && !((Que_StringObject *)obj)->rope) {
+                return;
+        }
+
+        if (state->gray_count + 1 > state->gray_allocated) {
+                size_t allocated = (state->gray_allocated) ? state->gray_allocated * 2 : GRAY_INIT_SIZE;
+
+                state->gray = ARRAY_GROW(state, state->gray,
+                        sizeof(Que_Object *) * state->gray_allocated,
+                        sizeof(Que_Object *) * allocated);
+                state->gray_allocated = allocated;
+        }
+
+        state->gray[state->gray_count++] = obj;
+}
+
+static void mark_value(Que_State *state, Que_Value *value) {
+        switch (QUE_VALUE_TYPE(*value)) {
+        case QUE_TYPE_STRING:
+        case QUE_TYPE_TABLE:
+        case QUE_TYPE_FUNCTION:
+                mark_object(state, QUE_AS_OBJECT(*value));
+                break;
+
+        default:
+                break;
+        }
+}
+
+void gc_shade(Que_State *state, Que_Value *value) {
+        mark_value(state, value);
+}
+
+void gc_table_barrier(Que_TableObject *table, Que_Value *key, Que_Value *value) {
+        Que_State *state = table->state;
+
+        if (state->gc_phase != GC_PHASE_MARK) {
+                return;
+        }
+
+        /* A white table will be traced later and find both by itself */
+        if (table->ob_head.marked == state->gc_mark) {
+                mark_value(state, key);
+                mark_value(state, value);
+        }
+}
+
+/* Marks up to budget keys and values of the table being scanned. Entries the
+ * table moves meanwhile are marked by GC_MOVE_BARRIER */
+static size_t scan_table(Que_State *state, size_t budget) {
+        Que_Value key, value;
+        size_t work = 0;
+
+        while (work < budget) {
+                if (!Que_TableNext(&state->gc_cursor, &key, &value)) {
+                        state->gc_cursor.table = NULL;
+                        break;
+                }
+
+                mark_value(state, &key);
+                mark_value(state, &value);
+                work++;
+        }
+
+        return work;
+}
+
+/* Marks everything obj refers to and returns the work that took. Tables are
+ * only set up to be scanned, see scan_table */
+static size_t blacken(Que_State *state, Que_Object *obj) {
+        size_t work = 1;
+
+        switch (obj->type) {
+        case QUE_TYPE_FUNCTION: {
+                Que_FunctionObject *func = (Que_FunctionObject *)obj;
+                size_t i;
+
+                mark_object(state, (Que_Object *)func->name);
+                for (i = 0; i < func->code.constants_size; i++) {
+                        mark_value(state, &func->code.constants[i]);
+                }
+                work += func->code.constants_size;
+        } break;
+
+        case QUE_TYPE_STRING: {
+                StringRope *rope = (StringRope *)obj;
+
+                mark_object(state, (Que_Object *)rope->left);
+                mark_object(state, (Que_Object *)rope->right);
+                mark_object(state, (Que_Object *)rope->flat);
+                work += 3;
+        } break;
+
+        case QUE_TYPE_TABLE:
+                Que_TableIterate((Que_TableObject *)obj, &state->gc_cursor);
+                break;
+
+        default:
+                break;
+        }
+
+        return work;
+}
+
+/* The stack and frames change without barriers, see finish_marking */
+static void mark_stack(Que_State *state) {
+        Que_Value *value;
+        CallFrame *frame;
+
+        for (value = state->stack; value < state->stack_top; value++) {
+                mark_value(state, value);
+        }
+
+        for (frame = state->frames; frame <= state->frame_current; frame++) {
+                mark_object(state, (Que_Object *)frame->func);
+        }
+}
+
+static void mark_roots(Que_State *state) {
+        size_t i;
+
+        mark_stack(state);
+
+        for (i = 0; i < state->globals_size; i++) {
+                mark_value(state, &state->globals[i].value);
+                mark_object(state, (Que_Object *)state->globals[i].name);
+        }
+
+        mark_object(state, (Que_Object *)state->global_indices);
+}
+
+/* Takes str out of the intern set, shifting back the strings after it */
+static void unintern(Que_State *state, Que_StringObject *str) {
+        size_t mask = state->strings_capacity - 1;
+        size_t hole = (size_t)(str->hash & mask);
+        size_t index;
+
+        while (state->strings[hole] != str) {
+                hole = (hole + 1) & mask;
+        }
+
+        for (index = (hole + 1) & mask; state->strings[index]; index = (index + 1) & mask) {
+                size_t home = (size_t)(state->strings[index]->hash & mask);
+
+                /* Move it unless its home slot is after the hole */
+                if (((index - home) & mask) >= ((index - hole) & mask)) {
+                        state->strings[hole] = state->strings[index];
+                        hole = index;
+                }
+        }
+
+        state->strings[hole] = NULL;
+        state->strings_count--;
+}
+
+static void start_cycle(Que_State *state) {
+        /* Flipping the mark makes every object white at once */
+        state->gc_mark = !state->gc_mark;
+        state->gc_phase = GC_PHASE_MARK;
+        state->gc_requested = QUE_FALSE;
+
+        mark_roots(state);
+}
+
+/**
+ * Called once nothing is left to trace. Marks the stack and frames again,
+ * since they change without barriers. Whatever that reaches is traced in
+ * later steps like everything else, and marking only ends on a pass that
+ * finds nothing new. Objects allocated meanwhile are already marked, so the
+ * passes run out, and the only atomic part is going over the stack once.
+ * Returns the work done.
+ */
+static size_t finish_marking(Que_State *state) {
+        size_t work = (size_t)(state->stack_top - state->stack) +
+                      (size_t)(state->frame_current - state->frames) + 1;
+
+        mark_stack(state);
+        if (state->gray_count == 0) {
+                state->gc_phase = GC_PHASE_SWEEP;
+                state->gc_sweep = &state->objects;
+        }
+
+        return work;
+}
+
+/* Sets when the next collection is due, from what survived the last one */
+static void set_threshold(Que_State *state) {
+        state->next_gc = state->bytes_allocated * GC_GROWTH;
+        if (state->next_gc < GC_MIN_THRESHOLD) {
+                state->next_gc = GC_MIN_THRESHOLD;
+        }
+
+        /* Under a memory limit, garbage makes allocations fail that a
+         * collection would have made room for, so start the next one halfway
+         * there */
+        if (state->memory_limit) {
+                size_t halfway = state->bytes_allocated;
+
+                if (state->memory_limit > POOL_MEMORY_USAGE(state)) {
+                        halfway += (state->memory_limit - POOL_MEMORY_USAGE(state)) / 2;
+                }
+
+                if (state->next_gc > halfway) {
+                        state->next_gc = halfway;
+                }
+        }
+}
+
+static void finish_cycle(Que_State *state) {
+        state->gc_phase = GC_PHASE_IDLE;
+        state->gc_sweep = NULL;
+
+        pool_trim(state);
+        set_threshold(state);
+}
+
+/* Works on the running collection until budget units of work are done */
+static void advance(Que_State *state, size_t budget) {
+        size_t work = 0;
+
+        while (work < budget && state->gc_phase == GC_PHASE_MARK) {
+                if (state->gc_cursor.table) {
+                        work += scan_table(state, budget - work);
+                } else if (state->gray_count == 0) {
+                        work += finish_marking(state);
+                } else {
+                        work += blacken(state, state->gray[--state->gray_count]);
+                }
+        }
+
+        /* Objects allocated since the cycle started are marked, and new ones
+         * are linked in before the sweep position, so neither is freed */
+        while (work < budget && state->gc_phase == GC_PHASE_SWEEP) {
+                Que_Object *obj = *state->gc_sweep;
+
+                if (!obj) {
+                        finish_cycle(state);
+                } else if (obj->marked == state->gc_mark) {
+                        state->gc_sweep = &obj->next;
+                } else {
+                        *state->gc_sweep = obj->next;
+                        if (obj->type == QUE_TYPE_STRING && ((Que_StringObject *)obj)->interned) {
+                                unintern(state, (Que_StringObject *)obj);
+                        }
+                        free_obj(state, obj);
+                }
+
+                work++;
+        }
+}
+
+static int near_limit(Que_State *state) {
+        return state->memory_limit &&
+               POOL_MEMORY_USAGE(state) > state->memory_limit - state->memory_limit / GC_LIMIT_MARGIN;
+}
+
+void gc_step(Que_State *state) {
+        if (state->gc_phase == GC_PHASE_IDLE) {
+                start_cycle(state);
+        }
+
+        if (state->gc_step_size == 0 || near_limit(state)) {
+                advance(state, (size_t)-1);
+        } else {
+                advance(state, state->gc_step_size);
+        }
+}
+
+void gc_make_room(Que_State *state) {
+        size_t limit = state->memory_limit;
+
+        if (!near_limit(state)) {
+                return;
+        }
+
+        /* The gray stack may have to grow, and the limit must not stop it */
+        state->memory_limit = 0;
+        gc_collect(state);
+        state->memory_limit = limit;
+        set_threshold(state);
+}
+
+void gc_collect(Que_State *state) {
+        /* Objects that died after the running cycle started would survive it */
+        if (state->gc_phase != GC_PHASE_IDLE) {
+                advance(state, (size_t)-1);
+        }
+
+        start_cycle(state);
+        advance(state, (size_t)-1);
+}
+
+void gc_unwind(Que_State *state) {
+        /* The failure may have been a push onto the gray stack, leaving an
+         * object marked that nothing is going to trace. The cycle is dropped
+         * instead, after marking every object so that none is black when the
+         * next one flips the mark */
+        if (state->gc_phase == GC_PHASE_MARK) {
+                Que_Object *obj;
+
+                for (obj = state->objects; obj; obj = obj->next) {
+                        obj->marked = state->gc_mark;
+                }
+
+                state->gc_phase = GC_PHASE_IDLE;
+                state->gray_count = 0;
+                state->gc_cursor.table = NULL;
+        }
+
+        /* Collecting could run out of memory again, so leave it to the next
+         * allocation */
+        state->gc_requested = QUE_TRUE;
+}
+
+void gc_free_all(Que_State *state) {
+        Que_Object *obj = state->objects;
+
+        while (obj) {
+                Que_Object *next = obj->next;
+
+                free_obj(state, obj);
+                obj = next;
+        }
+
+        state->objects = NULL;
+        state->gc_phase = GC_PHASE_IDLE;
+        state->gc_sweep = NULL;
+        state->gc_cursor.table = NULL;
+
+        if (state->gray) {
+                state->gray = FREE(state, state->gray, sizeof(Que_Object *) * state->gray_allocated);
+        }
+
+        state->gray_allocated = 0;
+        state->gray_count = 0;
+}
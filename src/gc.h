@@ -0,0 +1,126 @@
+#ifndef QUE_GC_H
+#define QUE_GC_H
+
+#include <que/state.h>
+
+/**
+ * A collection marks incrementally. Objects start out white, their marked
+ * field differing from the state's gc_mark. Marking one makes it gray, and it
+ * turns black once everything it refers to has been marked too. The stack
+ * and call frames are marked again whenever nothing is left to trace, and the
+ * marking phase ends once that finds nothing new. The white objects are then
+ * swept a few at a time.
+ */
+typedef enum {
+        GC_PHASE_IDLE,
+        GC_PHASE_MARK,
+        GC_PHASE_SWEEP
+} GcPhase;
+
+/**
+ * Sets up the collector fields of a new state.
+ */
+void gc_init(Que_State *state);
+
+/**
+ * Called by allocate_obj before obj is initialised. Does a step of the
+ * running collection, or starts one if reallocate has asked for it, then
+ * links obj into the object list of state. New objects are black while
+ * marking and survive the sweep that follows.
+ */
+void gc_track(Que_State *state, Que_Object *obj);
+
+/* Define QUE_DEBUG_STRESS_GC to do a full collection before every object
+ * allocation */
+
+/**
+ * Called by reallocate whenever memory is allocated or freed on behalf of
+ * state, with the change in bytes.
+ */
+void gc_account(Que_State *state, size_t old_size, size_t new_size);
+
+/**
+ * Collection steps are skipped while a state is paused, for instance while
+ * the parser is building functions that nothing else refers to yet. Write
+ * barriers still apply. Pauses nest.
+ */
+void gc_pause(Que_State *state);
+void gc_resume(Que_State *state);
+
+/**
+ * Does up to gc_step_size units of work on the running collection, starting
+ * one if none is running. Close to the memory limit of the state, the
+ * collection is finished instead.
+ */
+void gc_step(Que_State *state);
+
+/**
+ * Does a full collection if state is close to its memory limit, so that
+ * garbage does not make the next allocation fail. The collection itself may
+ * go over the limit. Only for points where no object is half built.
+ */
+void gc_make_room(Que_State *state);
+
+/**
+ * Finishes the running collection, if any, then does a full one that frees
+ * every object of state that can not be reached from the value stack, the
+ * call frames or the globals.
+ */
+void gc_collect(Que_State *state);
+
+/**
+ * Called once a script has been abandoned because memory ran out, with the
+ * stack and call frames back to where they were before it started. Drops the
+ * collection the failure may have interrupted and asks for a new one, which
+ * frees what the script left behind.
+ */
+void gc_unwind(Que_State *state);
+
+/**
+ * Frees every object of state, reachable or not.
+ */
+void gc_free_all(Que_State *state);
+
+/**
+ * Write barrier for the globals, which are only traced when a collection
+ * starts. A value stored into a global while marking is marked at once, or
+ * the sweep could free it while the global still refers to it.
+ */
+#define GC_BARRIER(state, value) do { \
+        if ((state)->gc_phase == GC_PHASE_MARK) { \
+                gc_shade((state), (value)); \
+        } \
+} while (0)
+
+void gc_shade(Que_State *state, Que_Value *value);
+
+/**
+ * Write barrier for Que_TableInsert. Marks key and value when they are stored
+ * into a table the running collection of its state has already reached.
+ */
+void gc_table_barrier(Que_TableObject *table, Que_Value *key, Que_Value *value);
+
+/**
+ * Barrier for an entry that table moves to another slot or part, as it does
+ * when it grows, takes a key out or moves keys to the array part. The scan of
+ * the table the collector is in the middle of only goes forward, and would
+ * miss an entry moved from where it has not been yet to where it has been,
+ * so key and value are marked while that scan runs.
+ */
+#define GC_MOVE_BARRIER(table, key, value) do { \
+        if ((table)->state->gc_cursor.table == (table)) { \
+                gc_table_barrier((table), (key), (value)); \
+        } \
+} while (0)
+
+/**
+ * The intern set does not keep its strings alive, so a string that is looked
+ * up in it during a collection is marked before it is handed out again.
+ */
+#define GC_REVIVE(state, obj) do { \
+        if ((state)->gc_phase != GC_PHASE_IDLE) { \
+                (obj)->marked = (state)->gc_mark; \
+        } \
+} while (0)
+
+#endif /* QUE_GC_H */
@@ -0,0 +1,152 @@
+#include "hash.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The hash is a port of wyhash (https://github.com/wangyi-fudan/wyhash), and
+ * hash_int is the splitmix64 finalizer. Both are keyed with a seed that is
+ * picked at random for each state. Strings, tables and constants only ever
+ * meet hashes from the state they belong to, so a script that learns how its
+ * own state hashes learns nothing about any other.
+ */
+
+#define P0 QUE_UINT64_C(0xa0761d6478bd642f)
+#define P1 QUE_UINT64_C(0xe7037ed1a0b428db)
+#define P2 QUE_UINT64_C(0x8ebc6af09c88c6e3)
+#define P3 QUE_UINT64_C(0x589965cc75374cc3)
+
+#if defined(__SIZEOF_INT128__)
+
+__extension__ typedef unsigned __int128 HashWide;
+
+/* Replaces a and b with the low and high words of a * b */
+static void hash_mum(Hash *a, Hash *b) {
+        HashWide r = (HashWide)*a * *b;
+
+        *a = (Hash)r;
+        *b = (Hash)(r >> 64);
+}
+
+#else
+
+static void hash_mum(Hash *a, Hash *b) {
+        Hash ha = *a >> 32, hb = *b >> 32, la = (Que_UInt64)(unsigned int)*a, lb = (Que_UInt64)(unsigned int)*b;
+        Hash rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        Hash t = rl + (rm0 << 32);
+        Hash c = t < rl;
+        Hash lo = t + (rm1 << 32);
+
+        c += lo < t;
+        *a = lo;
+        *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+}
+
+#endif
+
+static Hash hash_mix(Hash a, Hash b) {
+        hash_mum(&a, &b);
+        return a ^ b;
+}
+
+/* Reads are unaligned and in native byte order, hashes are not portable */
+static Hash read64(const Que_Byte *p) {
+        Hash v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static Hash read32(const Que_Byte *p) {
+        unsigned int v;
+        memcpy(&v, p, 4);
+        return v;
+}
+
+/* Reads 1 to 3 bytes */
+static Hash read_small(const Que_Byte *p, size_t size) {
+        return ((Hash)p[0] << 16) | ((Hash)p[size >> 1] << 8) | p[size - 1];
+}
+
+Hash hash_new_seed(void) {
+        static unsigned long made = 0;
+        FILE *urandom = fopen("/dev/urandom", "rb");
+        Hash seed = 0;
+
+        /* Only the seed is read, not a whole buffer of entropy */
+        if (urandom) {
+                setvbuf(urandom, NULL, _IONBF, 0);
+        }
+
+        if (!urandom || fread(&seed, sizeof(seed), 1, urandom) != 1) {
+                /* No entropy source, settle for the clock and an address. The
+                 * count keeps states made in the same tick apart */
+                seed = hash_mix((Hash)time(NULL) ^ P0, (Hash)clock() ^ P1);
+                seed = hash_mix(seed ^ (Hash)(size_t)&seed, (Hash)++made ^ P2);
+        }
+
+        if (urandom) {
+                fclose(urandom);
+        }
+
+        return seed;
+}
+
+Hash hash_bytes(Hash seed, const void *memory, size_t size) {
+        const Que_Byte *p = memory;
+        Hash s, a, b;
+
+        s = seed ^ hash_mix(seed ^ P0, P1);
+
+        if (size <= 16) {
+                if (size >= 4) {
+                        size_t middle = (size >> 3) << 2;
+
+                        a = (read32(p) << 32) | read32(p + middle);
+                        b = (read32(p + size - 4) << 32) | read32(p + size - 4 - middle);
+                } else if (size > 0) {
+                        a = read_small(p, size);
+                        b = 0;
+                } else {
+                        a = b = 0;
+                }
+        } else {
+                size_t left = size;
+
+                if (left > 48) {
+                        Hash s1 = s, s2 = s;
+
+                        do {
+                                s = hash_mix(read64(p) ^ P1, read64(p + 8) ^ s);
+                                s1 = hash_mix(read64(p + 16) ^ P2, read64(p + 24) ^ s1);
+                                s2 = hash_mix(read64(p + 32) ^ P3, read64(p + 40) ^ s2);
+                                p += 48;
+                                left -= 48;
+                        } while (left > 48);
+
+                        s ^= s1 ^ s2;
+                }
+
+                while (left > 16) {
+                        s = hash_mix(read64(p) ^ P1, read64(p + 8) ^ s);
+                        p += 16;
+                        left -= 16;
+                }
+
+                a = read64(p + left - 16);
+                b = read64(p + left - 8);
+        }
+
+        a ^= P1;
+        b ^= s;
+        hash_mum(&a, &b);
+
+        return hash_mix(a ^ P0 ^ (Hash)size, b ^ P1);
+}
+
+Hash hash_int(Hash seed, Hash value) {
+        value ^= seed;
+        value = (value ^ (value >> 30)) * QUE_UINT64_C(0xbf58476d1ce4e5b9);
+        value = (value ^ (value >> 27)) * QUE_UINT64_C(0x94d049bb133111eb);
+        return value ^ (value >> 31);
+}
@@ -0,0 +1,24 @@
+#ifndef QUE_HASH_H
+#define QUE_HASH_H
+
+#include <que/common.h>
+
+typedef Que_UInt64 Hash;
+
+/**
+ * Returns a new random seed. Every state hashes with its own, see Que_State.
+ */
+Hash hash_new_seed(void);
+
+/**
+ * Hashes size bytes of memory. Long inputs are consumed 48 bytes at a time in
+ * three independent lanes so the multiplies can overlap.
+ */
+Hash hash_bytes(Hash seed, const void *memory, size_t size);
+
+/**
+ * Mixes a single word, for keys that are not strings.
+ */
+Hash hash_int(Hash seed, Hash value);
+
+#endif /* QUE_HASH_H */
@@ -1,12 +1,13 @@
 #include <stdio.h>
 #include <que/state.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "defs.h"
 
 QUE_NORETURN void repl();
 
-QUE_NORETURN void load(const char *path);
+QUE_NORETURN void load(const char *path, Que_ExecutionMode mode);
 
 QUE_NORETURN void usage(const char *program);
 
@@ -16,7 +17,12 @@ int main(int argc, char *argv[]) {
                 repl();
 
         case 2:
-                load(argv[1]);
+                load(argv[1], QUE_MODE_STACK);
+
+        case 3:
+                if (strcmp(argv[1], "-r") == 0) {
+                        load(argv[2], QUE_MODE_REGISTER);
+                }
 
         default:
                 usage(argv[0]);
@@ -40,20 +46,30 @@ void repl() {
                         break;
                 }
 
-                if (Que_ExecuteString(state, line) != 0) {
+                switch (Que_ExecuteString(state, line)) {
+                case 0:
+                        break;
+
+                case QUE_ERROR_MEMORY:
+                        puts("[!] Out of memory");
+                        break;
+
+                default:
                         puts("[!] Execution error");
+                        break;
                 }
         }
 
         exit(-10);
 }
 
-void load(const char *path) {
+void load(const char *path, Que_ExecutionMode mode) {
         FILE *file = fopen(path, "rb");
         size_t size = 0;
         char *buf = NULL;
         Que_State *state = NULL;
         size_t bytes_read;
+        int status;
 
         if (!file) {
                 fprintf(stderr, "[!] Failed to open '%s'.\n", path);
@@ -87,7 +103,14 @@ void load(const char *path) {
                 goto cleanup;
         }
 
-        exit(Que_ExecuteString(state, buf));
+        Que_SetExecutionMode(state, mode);
+
+        status = Que_ExecuteString(state, buf);
+        if (status == QUE_ERROR_MEMORY) {
+                fprintf(stderr, "[!] Out of memory.\n");
+        }
+
+        exit(status);
 
 cleanup:
         if (file) {
@@ -106,6 +129,7 @@ cleanup:
  }
 
 void usage(const char *program) {
-        fprintf(stderr, "Usage: %s [script] or just %s to launch REPL\n", program, program);
+        fprintf(stderr, "Usage: %s [-r] [script] or just %s to launch REPL\n", program, program);
+        fprintf(stderr, "  -r  run the script with the register based interpreter\n");
         exit(-10);
 }
@@ -1,33 +1,82 @@
 #include "memory.h"
 
+#include "gc.h"
+#include "state_internal.h"
+
+#include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include <que/common.h>
 
+static size_t total_allocated = 0;
+
 QUE_NORETURN static void enomem(void) {
         fprintf(stderr, "[!] Fatal: QueVM is out of memory. Now exiting.\n");
         exit(25);
 }
 
-void *reallocate(void *buf, size_t old_size, size_t new_size) {
-        if ((old_size == 0) && (new_size > 0)) {
-                buf = malloc(new_size);
-                if (!buf) {
-                        enomem();
-                }
-                return buf;
-        } else if ((old_size > 0) && (new_size > 0)) {
-                void *temp = realloc(buf, new_size);
-                if (!temp) {
-                        enomem();
-                }
-                return temp;
-        } else if ((old_size > 0) && (new_size == 0)) {
+/* Unwinds to the script state is running, see Que_ExecuteString */
+QUE_NORETURN static void out_of_memory(Que_State *state) {
+        if (state && state->error_jump) {
+                longjmp(*state->error_jump, QUE_ERROR_MEMORY);
+        }
+
+        enomem();
+}
+
+void *memory_system_allocator(void *userdata, void *buf, size_t old_size, size_t new_size) {
+        (void)userdata;
+        (void)old_size;
+
+        if (new_size == 0) {
                 free(buf);
                 return NULL;
         }
 
-        assert(0 && "unreachable");
-        return NULL;
+        /* realloc of NULL is malloc */
+        return realloc(buf, new_size);
+}
+
+void *reallocate(Que_State *state, void *buf, size_t old_size, size_t new_size) {
+        assert((old_size > 0 || new_size > 0) && "unreachable");
+
+        /* Only scripts are held to the limit, the host can not unwind */
+        if (state && state->error_jump && state->memory_limit) {
+                size_t growth = pool_growth(state, old_size, new_size);
+
+                if (growth > 0 && POOL_MEMORY_USAGE(state) + growth > state->memory_limit) {
+                        out_of_memory(state);
+                }
+        }
+
+        /* ALLOCATE passes whatever the pointer held before */
+        if (old_size == 0) {
+                buf = NULL;
+        }
+
+        if (state) {
+                buf = pool_reallocate(state, buf, old_size, new_size);
+        } else {
+                buf = memory_system_allocator(NULL, buf, old_size, new_size);
+        }
+
+        /* A failed resize leaves the old block as it was */
+        if (!buf && new_size > 0) {
+                out_of_memory(state);
+        }
+
+        if (new_size > old_size) {
+                total_allocated += new_size - old_size;
+        }
+
+        if (state) {
+                gc_account(state, old_size, new_size);
+        }
+
+        return buf;
+}
+
+size_t memory_total_allocated(void) {
+        return total_allocated;
 }
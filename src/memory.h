@@ -2,11 +2,30 @@
 #define QUE_MEMORY_H
 
 #include <que/common.h>
+#include <que/state.h>
 
-void *reallocate(void *buf, size_t old_size, size_t new_size);
+/**
+ * Gets memory from the pools and allocator of state (see pool.h), or from
+ * memory_system_allocator when state is NULL. If that fails, or state would
+ * pass its memory limit, it unwinds to the script state is running, or exits
+ * if there is none (see Que_ExecuteString). Whatever is being resized is left
+ * as it was, so callers update their own sizes only after it returns.
+ */
+void *reallocate(Que_State *state, void *buf, size_t old_size, size_t new_size);
 
-#define ALLOCATE(buf, size) reallocate(buf, 0, size)
-#define FREE(buf, size) reallocate(buf, size, 0)
-#define ARRAY_GROW(array, old_size, new_size) reallocate(array, old_size, new_size)
+/**
+ * The Que_Allocator of states created without one, built on malloc.
+ */
+void *memory_system_allocator(void *userdata, void *buf, size_t old_size, size_t new_size);
+
+/**
+ * Returns the number of bytes that have been requested through reallocate
+ * since the start of the process. Frees are not subtracted.
+ */
+size_t memory_total_allocated(void);
+
+#define ALLOCATE(state, buf, size) reallocate(state, buf, 0, size)
+#define FREE(state, buf, size) reallocate(state, buf, size, 0)
+#define ARRAY_GROW(state, array, old_size, new_size) reallocate(state, array, old_size, new_size)
 
 #endif /* QUE_MEMORY_H */
@@ -4,36 +4,166 @@
 #include <que/common.h>
 
 /**
- * There are two types of opcodes in Que. There are 1 byte opcodes which do not
- * have an argument, and there are 3 byte opcodes which have 1 byte for the
- * opcode, and 2 bytes for the argument.
- * 
- * No-arg opcodes can be denoted by the OP(name) macro in opcodes.txt, while ones
- * with an arg can be denoted with OP_ARG(name).
+ * Opcodes are declared in opcodes.txt with one of these macros, depending on
+ * the arguments that follow the opcode byte in the chunk:
+ *
+ * OP(name)       no argument, 1 byte in total.
+ * OP_BYTE(name)  a 1 byte argument, 2 bytes in total. When the argument does
+ *                not fit in a byte, the instruction is prefixed with OP_WIDE
+ *                and the argument is written as 2 bytes instead, 4 bytes in
+ *                total.
+ * OP_BYTE2(name) two 1 byte arguments, 3 bytes in total.
+ * OP_ARG(name)   a 2 byte argument, 3 bytes in total.
+ *
+ * 2 byte arguments are stored big-endian.
 */
 
 #define OP(name) name
+#define OP_BYTE(name) name
+#define OP_BYTE2(name) name
 #define OP_ARG(name) name
 typedef enum {
 #include "opcodes.txt"
 } Op;
 #undef OP
+#undef OP_BYTE
+#undef OP_BYTE2
 #undef OP_ARG
 
 static const char *OPCODE_NAMES[] = {
 #define OP(name) #name
+#define OP_BYTE(name) #name
+#define OP_BYTE2(name) #name
 #define OP_ARG(name) #name
 #include "opcodes.txt"
 #undef OP
+#undef OP_BYTE
+#undef OP_BYTE2
 #undef OP_ARG
 };
 
-static int OPCODE_HAS_ARG[] = {
-#define OP(name) 0
-#define OP_ARG(name) 1
+typedef enum {
+        OPCODE_ARG_NONE,
+        OPCODE_ARG_BYTE,
+        OPCODE_ARG_BYTE2,
+        OPCODE_ARG_WORD
+} OpcodeArg;
+
+static OpcodeArg OPCODE_ARGS[] = {
+#define OP(name) OPCODE_ARG_NONE
+#define OP_BYTE(name) OPCODE_ARG_BYTE
+#define OP_BYTE2(name) OPCODE_ARG_BYTE2
+#define OP_ARG(name) OPCODE_ARG_WORD
+#include "opcodes.txt"
+#undef OP
+#undef OP_BYTE
+#undef OP_BYTE2
+#undef OP_ARG
+};
+
+static int OPCODE_SIZES[] = {
+#define OP(name) 1
+#define OP_BYTE(name) 2
+#define OP_BYTE2(name) 3
+#define OP_ARG(name) 3
 #include "opcodes.txt"
 #undef OP
+#undef OP_BYTE
+#undef OP_BYTE2
 #undef OP_ARG
 };
 
+/* Size in bytes of the instruction starting at code, including any prefix */
+#define INSTRUCTION_SIZE(code) \
+        (((code)[0] == OP_WIDE) ? 4 : OPCODE_SIZES[(code)[0]])
+
+/**
+ * The register instruction set used by vm_execute_registers is declared in
+ * ropcodes.txt. A, B and C are 1 byte register operands, which index the
+ * slots of the current frame, and K is a 2 byte constant index:
+ *
+ * RA(name)    A, 2 bytes in total.
+ * RAB(name)   A, B, 3 bytes in total.
+ * RABC(name)  A, B, C, 4 bytes in total.
+ * RAK(name)   A, K, 4 bytes in total.
+ * RABK(name)  A, B, K, 5 bytes in total.
+ * RAG(name)   A, G, 4 bytes in total, where G is a 2 byte index into the
+ *             state's global slots.
+ *
+ * A is the destination register of every instruction that produces a value.
+ */
+
+#define RA(name) name
+#define RAB(name) name
+#define RABC(name) name
+#define RAK(name) name
+#define RABK(name) name
+#define RAG(name) name
+typedef enum {
+#include "ropcodes.txt"
+} ROp;
+#undef RA
+#undef RAB
+#undef RABC
+#undef RAK
+#undef RABK
+#undef RAG
+
+static const char *ROPCODE_NAMES[] = {
+#define RA(name) #name
+#define RAB(name) #name
+#define RABC(name) #name
+#define RAK(name) #name
+#define RABK(name) #name
+#define RAG(name) #name
+#include "ropcodes.txt"
+#undef RA
+#undef RAB
+#undef RABC
+#undef RAK
+#undef RABK
+#undef RAG
+};
+
+typedef enum {
+        ROPCODE_ARG_A,
+        ROPCODE_ARG_AB,
+        ROPCODE_ARG_ABC,
+        ROPCODE_ARG_AK,
+        ROPCODE_ARG_ABK,
+        ROPCODE_ARG_AG
+} ROpcodeArg;
+
+static ROpcodeArg ROPCODE_ARGS[] = {
+#define RA(name) ROPCODE_ARG_A
+#define RAB(name) ROPCODE_ARG_AB
+#define RABC(name) ROPCODE_ARG_ABC
+#define RAK(name) ROPCODE_ARG_AK
+#define RABK(name) ROPCODE_ARG_ABK
+#define RAG(name) ROPCODE_ARG_AG
+#include "ropcodes.txt"
+#undef RA
+#undef RAB
+#undef RABC
+#undef RAK
+#undef RABK
+#undef RAG
+};
+
+static int ROPCODE_SIZES[] = {
+#define RA(name) 2
+#define RAB(name) 3
+#define RABC(name) 4
+#define RAK(name) 4
+#define RABK(name) 5
+#define RAG(name) 4
+#include "ropcodes.txt"
+#undef RA
+#undef RAB
+#undef RABC
+#undef RAK
+#undef RABK
+#undef RAG
+};
+
 #endif /* QUE_OPCODES_H */
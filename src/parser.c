@@ -6,10 +6,13 @@
 #include <stdlib.h>
 
 #include "lexer.h"
+#include "memory.h"
 #include "opcodes.h"
+#include "state_internal.h"
 #include "value_internal.h"
 
 #define MAX_LOCALS (QUE_BYTE_MAX + 1)
+#define MAX_REGISTERS (QUE_BYTE_MAX + 1)
 
 typedef struct {
         Token name;
@@ -31,6 +34,9 @@ struct Compiler {
         Local locals[MAX_LOCALS];
         int local_count;
         int scope_depth;
+
+        /* Offset of the last instruction emitted, including any OP_WIDE */
+        size_t last_instruction;
 };
 
 
@@ -43,6 +49,8 @@ static struct {
         ScopeType scope_type;
 
         const char *filename;
+        Que_State *vm;
+        Que_ExecutionMode mode;
 
         Compiler *current_compiler;
 } state;
@@ -50,7 +58,7 @@ static struct {
 static void error(const char *format, ...);
 
 static void token_stringify(Que_Value *out_string, Token *token) {
-        Que_ValueString(out_string, token->start, token->length);
+        QUE_SET_OBJECT(*out_string, QUE_TYPE_STRING, state_intern(state.vm, token->start, token->length));
 }
 
 static void init_compiler(Compiler *enclosing, Compiler *c, Token *identifier_token) {
@@ -61,10 +69,11 @@ static void init_compiler(Compiler *enclosing, Compiler *c, Token *identifier_to
 
         c->enclosing = enclosing;
 
-        c->func = allocate_function(&identifier);
+        c->func = allocate_function(state.vm, &identifier);
         c->type = (c->enclosing) ? SCOPE_FUNCTION : SCOPE_SCRIPT;
         c->local_count = 0;
         c->scope_depth = 0;
+        c->last_instruction = 0;
         state.current_compiler = c;
 
         local = &state.current_compiler->locals[state.current_compiler->local_count++];
@@ -129,6 +138,11 @@ static int does_it_exist(Token *name) {
         return 0;
 }
 
+/* Returns the index of the global named name in the VM's global slots */
+static Que_Word global_slot(Token *name) {
+        return state_global_slot(state.vm, name->start, name->length);
+}
+
 static int resolve_local(Token *name) {
         int i;
         for (i = state.current_compiler->local_count - 1; i >= 0; i--) {
@@ -147,19 +161,17 @@ static int resolve_local(Token *name) {
 }
 
 static void emit(Que_Byte b) {
-        chunk_write_byte(current_chunk(), b);
+        state.current_compiler->last_instruction = current_chunk()->code_size;
+        chunk_write_byte(state.vm, current_chunk(), b);
 }
 
-static void emit_word(Que_Word w);
-
-static void emit_constant(Que_Value *v) {
-        emit_word(
-                chunk_write_constant(current_chunk(), v)
-        );
+static void emit_arg(Que_Byte op, Que_Word arg) {
+        state.current_compiler->last_instruction = current_chunk()->code_size;
+        chunk_write_instruction(state.vm, current_chunk(), op, arg);
 }
 
-void emit_word(Que_Word w) {
-        chunk_write_word(current_chunk(), w);
+static void emit_constant(Que_Byte op, Que_Value *v) {
+        emit_arg(op, chunk_write_constant(state.vm, current_chunk(), v));
 }
 
 void begin_scope() {
@@ -179,15 +191,406 @@ void end_scope() {
         */
 }
 
+/**
+ * Rewrites common instruction sequences in a finished chunk into the
+ * superinstructions at the end of opcodes.txt:
+ *
+ *      OP_GET_GLOBAL g, OP_TABLE_GET k -> OP_GET_GLOBAL_FIELD g, k
+ *      OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD -> OP_ADD_LOCALS a, b
+ *      OP_GET_LOCAL a, OP_GET_LOCAL b, OP_MULTIPLY -> OP_MULTIPLY_LOCALS a, b
+ *
+ * Only the narrow forms are fused; an OP_WIDE prefixed operand is left alone.
+ * Every rewrite is shorter than what it replaces, so the chunk is rewritten in
+ * place.
+ */
+static void peephole(Chunk *chunk) {
+        Que_Byte *code = chunk->code;
+        size_t size = chunk->code_size;
+        size_t read, write;
+
+        /* Fusing moves code around, and jump targets are not relocated */
+        for (read = 0; read < size; read += INSTRUCTION_SIZE(&code[read])) {
+                if (code[read] == OP_JUMP || code[read] == OP_JUMP_IF_FALSE) {
+                        return;
+                }
+        }
+
+        read = write = 0;
+        while (read < size) {
+                size_t second = read + INSTRUCTION_SIZE(&code[read]);
+                size_t third = (second < size) ? second + INSTRUCTION_SIZE(&code[second]) : size;
+
+                if (second < size &&
+                    code[read] == OP_GET_GLOBAL &&
+                    code[second] == OP_TABLE_GET) {
+                        Que_Byte global = code[read + 1];
+                        Que_Byte field = code[second + 1];
+
+                        code[write] = OP_GET_GLOBAL_FIELD;
+                        code[write + 1] = global;
+                        code[write + 2] = field;
+                        write += OPCODE_SIZES[OP_GET_GLOBAL_FIELD];
+                        read = third;
+                } else if (third < size &&
+                           code[read] == OP_GET_LOCAL &&
+                           code[second] == OP_GET_LOCAL &&
+                           (code[third] == OP_ADD || code[third] == OP_MULTIPLY)) {
+                        Que_Byte a = code[read + 1];
+                        Que_Byte b = code[second + 1];
+                        Que_Byte fused = (code[third] == OP_ADD) ? OP_ADD_LOCALS : OP_MULTIPLY_LOCALS;
+
+                        code[write] = fused;
+                        code[write + 1] = a;
+                        code[write + 2] = b;
+                        write += OPCODE_SIZES[fused];
+                        read = third + OPCODE_SIZES[code[third]];
+                } else {
+                        size_t length = INSTRUCTION_SIZE(&code[read]);
+
+                        memmove(&code[write], &code[read], length);
+                        write += length;
+                        read += length;
+                }
+        }
+
+        chunk->code_size = write;
+}
+
+/**
+ * A value on the operand stack of the stack code being translated to registers.
+ * Constants and copies of locals are only written to their own slot when
+ * something needs them there.
+ */
+typedef enum {
+        STACK_VALUE_REGISTER,
+        STACK_VALUE_CONSTANT
+} StackValueType;
+
+typedef struct {
+        StackValueType type;
+        Que_Word index; /* Register or constant index */
+} StackValue;
+
+typedef struct {
+        Chunk out;
+        StackValue stack[MAX_REGISTERS];
+        int depth;
+        int registers; /* Highest depth reached */
+
+        /* Offset in out of the destination register written by the last
+         * instruction, or 0 if that instruction can not be retargeted */
+        size_t last_dst;
+} RegisterGen;
+
+/* Outside of registerize so that parser_unwind can find its code */
+static RegisterGen register_gen;
+
+static void reg_emit(RegisterGen *gen, Que_Byte op, Que_Byte a) {
+        chunk_write_byte(state.vm, &gen->out, op);
+        chunk_write_byte(state.vm, &gen->out, a);
+        gen->last_dst = 0;
+}
+
+static void reg_emit_ab(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Byte b) {
+        reg_emit(gen, op, a);
+        chunk_write_byte(state.vm, &gen->out, b);
+}
+
+static void reg_emit_abc(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Byte b, Que_Byte c) {
+        reg_emit_ab(gen, op, a, b);
+        chunk_write_byte(state.vm, &gen->out, c);
+}
+
+static void reg_emit_ak(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Word k) {
+        reg_emit(gen, op, a);
+        chunk_write_word(state.vm, &gen->out, k);
+}
+
+/*
+ * The reg_emit_dst* variants are for instructions that only write register a,
+ * so a following store to a local may write the local directly instead.
+ */
+static void reg_emit_dst(RegisterGen *gen, Que_Byte op, Que_Byte a) {
+        reg_emit(gen, op, a);
+        gen->last_dst = gen->out.code_size - 1;
+}
+
+static void reg_emit_dst_ab(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Byte b) {
+        reg_emit_ab(gen, op, a, b);
+        gen->last_dst = gen->out.code_size - 2;
+}
+
+static void reg_emit_dst_abc(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Byte b, Que_Byte c) {
+        reg_emit_abc(gen, op, a, b, c);
+        gen->last_dst = gen->out.code_size - 3;
+}
+
+static void reg_emit_dst_ak(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Word k) {
+        reg_emit_ak(gen, op, a, k);
+        gen->last_dst = gen->out.code_size - 3;
+}
+
+static void reg_emit_dst_abk(RegisterGen *gen, Que_Byte op, Que_Byte a, Que_Byte b, Que_Word k) {
+        reg_emit_ab(gen, op, a, b);
+        chunk_write_word(state.vm, &gen->out, k);
+        gen->last_dst = gen->out.code_size - 4;
+}
+
+/* Makes sure the value at depth is stored in its own slot */
+static void reg_materialize(RegisterGen *gen, int depth) {
+        StackValue *value = &gen->stack[depth];
+
+        if (value->type == STACK_VALUE_CONSTANT) {
+                reg_emit_ak(gen, ROP_LOAD_CONST, depth, value->index);
+        } else if (value->index != depth) {
+                reg_emit_ab(gen, ROP_MOVE, depth, value->index);
+        }
+
+        value->type = STACK_VALUE_REGISTER;
+        value->index = depth;
+}
+
+/* Returns a register holding the value at depth */
+static Que_Byte reg_operand(RegisterGen *gen, int depth) {
+        if (gen->stack[depth].type == STACK_VALUE_CONSTANT) {
+                reg_materialize(gen, depth);
+        }
+
+        return gen->stack[depth].index;
+}
+
+static int reg_push(RegisterGen *gen) {
+        StackValue *value;
+
+        if (gen->depth == MAX_REGISTERS) {
+                error("Expression needs more than %d registers", MAX_REGISTERS);
+                gen->depth = 0;
+        }
+
+        value = &gen->stack[gen->depth];
+        value->type = STACK_VALUE_REGISTER;
+        value->index = gen->depth;
+
+        if (gen->depth == gen->registers) {
+                gen->registers++;
+        }
+
+        return gen->depth++;
+}
+
+static void reg_binary(RegisterGen *gen, Que_Byte op) {
+        int dst = gen->depth - 2;
+        Que_Byte lhs = reg_operand(gen, dst);
+        Que_Byte rhs = reg_operand(gen, dst + 1);
+
+        gen->depth = dst;
+        reg_emit_dst_abc(gen, op, reg_push(gen), lhs, rhs);
+}
+
+static void reg_unary(RegisterGen *gen, Que_Byte op) {
+        int dst = gen->depth - 1;
+        Que_Byte operand = reg_operand(gen, dst);
+
+        gen->depth = dst;
+        reg_emit_dst_ab(gen, op, reg_push(gen), operand);
+}
+
+static void reg_set_local(RegisterGen *gen, Que_Byte slot) {
+        StackValue *top = &gen->stack[gen->depth - 1];
+        int i;
+
+        /* Anything still reading the old value of the local needs a copy */
+        for (i = 0; i < gen->depth - 1; i++) {
+                if (i != slot &&
+                    gen->stack[i].type == STACK_VALUE_REGISTER &&
+                    gen->stack[i].index == slot) {
+                        reg_materialize(gen, i);
+                }
+        }
+
+        if (top->type == STACK_VALUE_CONSTANT) {
+                reg_emit_ak(gen, ROP_LOAD_CONST, slot, top->index);
+        } else if (top->index == gen->depth - 1 && gen->last_dst != 0 &&
+                   gen->out.code[gen->last_dst] == top->index) {
+                /* Write the result straight into the local */
+                gen->out.code[gen->last_dst] = slot;
+        } else if (top->index != slot) {
+                reg_emit_ab(gen, ROP_MOVE, slot, top->index);
+        }
+
+        top->type = STACK_VALUE_REGISTER;
+        top->index = slot;
+        gen->stack[slot] = *top;
+        gen->last_dst = 0;
+}
+
+/**
+ * Translates the finished stack code of a chunk into the register instruction
+ * set from ropcodes.txt. The stack code is walked with a compile time model of
+ * the operand stack in which depth n of the current frame is register n. Since
+ * locals live at the bottom of the frame, GET_LOCAL a, GET_LOCAL b, ADD becomes
+ * a single ROP_ADD reading both locals, and a following SET_LOCAL writes the
+ * result into the local directly. base is the number of slots in use when the
+ * chunk starts running: the function and its arguments. Returns how many
+ * registers the code uses.
+ */
+static int registerize(Chunk *chunk, int base) {
+        RegisterGen *gen = &register_gen;
+        size_t i;
+
+        gen->out.code = ALLOCATE(state.vm, NULL, chunk->code_size);
+        gen->out.code_allocated = chunk->code_size;
+        gen->out.code_size = 0;
+        gen->depth = 0;
+        gen->registers = 0;
+        gen->last_dst = 0;
+
+        while (gen->depth < base) {
+                reg_push(gen);
+        }
+
+        for (i = 0; i < chunk->code_size; i += INSTRUCTION_SIZE(&chunk->code[i])) {
+                Que_Byte op = chunk->code[i];
+                Que_Word arg = 0;
+
+                if (op == OP_WIDE) {
+                        op = chunk->code[i + 1];
+                        arg = (chunk->code[i + 2] << 8) + chunk->code[i + 3];
+                } else if (OPCODE_ARGS[op] == OPCODE_ARG_BYTE) {
+                        arg = chunk->code[i + 1];
+                } else if (OPCODE_ARGS[op] == OPCODE_ARG_WORD) {
+                        arg = (chunk->code[i + 1] << 8) + chunk->code[i + 2];
+                }
+
+                switch (op) {
+                case OP_PUSH: {
+                        int dst = reg_push(gen);
+                        gen->stack[dst].type = STACK_VALUE_CONSTANT;
+                        gen->stack[dst].index = arg;
+                } break;
+
+                case OP_PUSH_TRUE: reg_emit_dst(gen, ROP_LOAD_TRUE, reg_push(gen)); break;
+                case OP_PUSH_FALSE: reg_emit_dst(gen, ROP_LOAD_FALSE, reg_push(gen)); break;
+                case OP_PUSH_NIL: reg_emit_dst(gen, ROP_LOAD_NIL, reg_push(gen)); break;
+
+                case OP_POP:
+                        gen->depth--;
+                        break;
+
+                case OP_ADD: reg_binary(gen, ROP_ADD); break;
+                case OP_SUBTRACT: reg_binary(gen, ROP_SUBTRACT); break;
+                case OP_MULTIPLY: reg_binary(gen, ROP_MULTIPLY); break;
+                case OP_DIVIDE: reg_binary(gen, ROP_DIVIDE); break;
+                case OP_POW: reg_binary(gen, ROP_POW); break;
+                case OP_AND: reg_binary(gen, ROP_AND); break;
+                case OP_OR: reg_binary(gen, ROP_OR); break;
+                case OP_BAND: reg_binary(gen, ROP_BAND); break;
+                case OP_BOR: reg_binary(gen, ROP_BOR); break;
+                case OP_BXOR: reg_binary(gen, ROP_BXOR); break;
+                case OP_LSHIFT: reg_binary(gen, ROP_LSHIFT); break;
+                case OP_RSHIFT: reg_binary(gen, ROP_RSHIFT); break;
+                case OP_GR: reg_binary(gen, ROP_GR); break;
+                case OP_GREQ: reg_binary(gen, ROP_GREQ); break;
+                case OP_LE: reg_binary(gen, ROP_LE); break;
+                case OP_LEQ: reg_binary(gen, ROP_LEQ); break;
+                case OP_EQ: reg_binary(gen, ROP_EQ); break;
+                case OP_NEQ: reg_binary(gen, ROP_NEQ); break;
+
+                case OP_NEGATE: reg_unary(gen, ROP_NEGATE); break;
+                case OP_NOT: reg_unary(gen, ROP_NOT); break;
+                case OP_BNOT: reg_unary(gen, ROP_BNOT); break;
+
+                case OP_TABLE_GET: {
+                        Que_Byte table = reg_operand(gen, gen->depth - 1);
+
+                        gen->depth--;
+                        reg_emit_dst_abk(gen, ROP_GET_FIELD, reg_push(gen), table, arg);
+                } break;
+
+                case OP_GET_LOCAL: {
+                        int dst;
+
+                        reg_materialize(gen, arg);
+                        dst = reg_push(gen);
+                        gen->stack[dst].index = arg;
+                } break;
+
+                case OP_SET_LOCAL:
+                        reg_set_local(gen, arg);
+                        break;
+
+                case OP_GET_GLOBAL:
+                        reg_emit_dst_ak(gen, ROP_GET_GLOBAL, reg_push(gen), arg);
+                        break;
+
+                case OP_SET_GLOBAL:
+                        reg_emit_ak(gen, ROP_SET_GLOBAL, reg_operand(gen, gen->depth - 1), arg);
+                        break;
+
+                case OP_DEFINE_GLOBAL:
+                        reg_emit_ak(gen, ROP_DEFINE_GLOBAL, reg_operand(gen, gen->depth - 1), arg);
+                        gen->depth--;
+                        break;
+
+                case OP_CALL:
+                case OP_TAIL_CALL: {
+                        int function = gen->depth - arg - 1;
+                        int j;
+
+                        /* The callee's frame starts at the function's slot */
+                        for (j = function; j < gen->depth; j++) {
+                                reg_materialize(gen, j);
+                        }
+
+                        gen->depth = function;
+                        reg_emit_ab(gen, (op == OP_CALL) ? ROP_CALL : ROP_TAIL_CALL, reg_push(gen), arg);
+                } break;
+
+                case OP_RETURN:
+                        reg_emit(gen, ROP_RETURN, (gen->depth > 0) ? reg_operand(gen, gen->depth - 1) : 0);
+                        break;
+
+                default:
+                        error("%s is not supported in register mode", OPCODE_NAMES[op]);
+                        break;
+                }
+        }
+
+        gen->out.constants = chunk->constants;
+        gen->out.constants_allocated = chunk->constants_allocated;
+        gen->out.constants_size = chunk->constants_size;
+        gen->out.caches = chunk->caches;
+        gen->out.caches_allocated = chunk->caches_allocated;
+        gen->out.constant_map = chunk->constant_map;
+        gen->out.constant_map_capacity = chunk->constant_map_capacity;
+        FREE(state.vm, chunk->code, chunk->code_allocated);
+        *chunk = gen->out;
+        gen->out.code = NULL;
+
+        return gen->registers;
+}
+
 static Que_FunctionObject *end_compiler() {
         Que_FunctionObject *result = state.current_compiler->func;
 
+        emit(OP_PUSH_NIL);
         emit(OP_RETURN);
-        emit_word(result->arity);
+        chunk_finish(state.vm, current_chunk());
+
+        if (state.mode == QUE_MODE_REGISTER) {
+                int base = (state.current_compiler->type == SCOPE_FUNCTION) ? result->arity + 1 : 0;
+                result->registers = registerize(current_chunk(), base);
+        } else {
+                peephole(current_chunk());
+        }
 
 #ifdef QUE_DEBUG_INSTRUCTIONS
         printf("Function: %s\n", state.current_compiler->func->name->str);
-        chunk_disassemble(current_chunk());
+        if (state.mode == QUE_MODE_REGISTER) {
+                chunk_disassemble_registers(current_chunk());
+        } else {
+                chunk_disassemble(current_chunk());
+        }
         puts("");
 #endif
 
@@ -265,15 +668,23 @@ static int consume(TokenType type, const char *format, ...) {
         return QUE_TRUE;
 }
 
-void parser_init(const char *filename, const char *source) {
+void parser_init(Que_State *vm, const char *filename, const char *source) {
         lexer_init(source);
         lexer_next(&(state.current));
         state.had_error = state.panic_mode = QUE_FALSE;
         state.scope_type = SCOPE_SCRIPT;
         state.filename = filename;
+        state.vm = vm;
+        state.mode = vm->mode;
         state.current_compiler = NULL;
 }
 
+void parser_unwind(void) {
+        if (register_gen.out.code) {
+                register_gen.out.code = FREE(state.vm, register_gen.out.code, register_gen.out.code_allocated);
+        }
+}
+
 void parse_expression(void);
 void parse_primary(void);
 
@@ -282,28 +693,20 @@ void parse_table_access(void) {
         Que_Value v;
         consume(TOK_IDENTIFIER, "Expected identifier for table access");
 
-        v.type = QUE_TYPE_STRING;
-        v.value.o = (Que_Object *)allocate_string(field.start, field.length);
+        token_stringify(&v, &field);
 
-        emit(OP_PUSH);
-        emit_constant(&v);
-
-        emit(OP_TABLE_GET);
+        emit_constant(OP_TABLE_GET, &v);
 }
 
 void parse_primary(void) {
         if (match(TOK_INT)) {
                 Que_Value v;
-                v.type = QUE_TYPE_INT;
-                v.value.i = strtol(state.previous.start, NULL, 10);
-                emit(OP_PUSH);
-                emit_constant(&v);
+                QUE_SET_INT(v, strtol(state.previous.start, NULL, 10));
+                emit_constant(OP_PUSH, &v);
         } else if (match(TOK_FLOAT)) {
                 Que_Value v;
-                v.type = QUE_TYPE_FLOAT;
-                v.value.f = strtod(state.previous.start, NULL);
-                emit(OP_PUSH);
-                emit_constant(&v);
+                QUE_SET_FLOAT(v, strtod(state.previous.start, NULL));
+                emit_constant(OP_PUSH, &v);
         } else if (match(TOK_IDENTIFIER)) {
                 Token identifier = state.previous;
 		int slot = resolve_local(&identifier);
@@ -312,25 +715,15 @@ void parse_primary(void) {
                         parse_expression();
 
                         if (slot == -1) {
-                                Que_Value str;
-                                token_stringify(&str, &identifier);
-
-                                emit(OP_SET_GLOBAL);
-                                emit_constant(&str);
+                                emit_arg(OP_SET_GLOBAL, global_slot(&identifier));
                         } else {
-                                emit(OP_SET_LOCAL);
-                                emit_word(slot);
+                                emit_arg(OP_SET_LOCAL, slot);
                         }
                 } else {
                         if (slot == -1) {
-                                Que_Value str;
-                                token_stringify(&str, &identifier);
-
-                                emit(OP_GET_GLOBAL);
-                                emit_constant(&str);
+                                emit_arg(OP_GET_GLOBAL, global_slot(&identifier));
                         } else {
-                                emit(OP_GET_LOCAL);
-                                emit_word(slot);
+                                emit_arg(OP_GET_LOCAL, slot);
                 }
 
                 if (match(TOK_DOT)) {
@@ -341,17 +734,13 @@ void parse_primary(void) {
         } else if (match(TOK_STRING)) {
                 Que_Value val;
 
-                val.type = QUE_TYPE_STRING;
-                val.value.o = (Que_Object *)allocate_string(state.previous.start, state.previous.length);
-                emit(OP_PUSH);
-                emit_constant(&val);
+                token_stringify(&val, &state.previous);
+                emit_constant(OP_PUSH, &val);
         } else if (match(TOK_CHAR)) {
                 Que_Value val;
 
-                val.type = QUE_TYPE_CHAR;
-                val.value.c = state.previous.start[0];
-                emit(OP_PUSH);
-                emit_constant(&val);
+                QUE_SET_CHAR(val, state.previous.start[0]);
+                emit_constant(OP_PUSH, &val);
         } else if (match(TOK_TRUE)) {
                 emit(OP_PUSH_TRUE);
         } else if (match(TOK_FALSE)) {
@@ -381,8 +770,7 @@ void parse_primary(void) {
                 consume(TOK_CLOSE_PAREN, "expected ')' after function call");
 
                 /* Code */
-                emit(OP_CALL);
-                emit_word(argc);
+                emit_arg(OP_CALL, argc);
         }
 }
 
@@ -540,20 +928,19 @@ void declare_variable(void) {
         }
 }
 
-void define_variable(Que_Value *identifier) {	
+void define_variable(Token *identifier) {	
         parse_expression();
 
 	if (state.current_compiler->type == SCOPE_SCRIPT) {
-		emit(OP_DEFINE_GLOBAL);
-		emit_constant(identifier);
+		emit_arg(OP_DEFINE_GLOBAL, global_slot(identifier));
 	}
 }
 
 void parse_var_declaration() {
-	Que_Value identifier;
+	Token identifier;
 	
         declare_variable();
-	token_stringify(&identifier, &state.previous);
+	identifier = state.previous;
 
         if (match(TOK_EQUAL)) {
                 define_variable(&identifier);
@@ -593,11 +980,11 @@ static int parse_function_args(void) {
 
 void parse_function_declaration() {
         Compiler compiler;
-        Que_Value identifier;
+        Token identifier;
         Que_Value function;
 
         consume(TOK_IDENTIFIER, "expected function identifier");
-        token_stringify(&identifier, &state.previous);
+        identifier = state.previous;
 
         init_compiler(state.current_compiler, &compiler, &state.previous);
         begin_scope();
@@ -616,10 +1003,8 @@ void parse_function_declaration() {
 
         Que_ValueFunction(&function, end_compiler());
 
-        emit(OP_PUSH);
-        emit_constant(&function);
-        emit(OP_DEFINE_GLOBAL);
-        emit_constant(&identifier);
+        emit_constant(OP_PUSH, &function);
+        emit_arg(OP_DEFINE_GLOBAL, global_slot(&identifier));
 }
 
 void parse_if_statement() {
@@ -646,8 +1031,22 @@ void parse_expression_statement() {
 }
 
 void parse_return_statement() {
+        Que_Byte *last;
+
         parse_expression();
         consume(TOK_EOL, "expected newline after return");
+
+        /* return f(x) runs f in place of the current function */
+        last = &current_chunk()->code[state.current_compiler->last_instruction];
+        if (last[0] == OP_WIDE) {
+                last++;
+        }
+
+        if (state.current_compiler->type == SCOPE_FUNCTION && last[0] == OP_CALL) {
+                last[0] = OP_TAIL_CALL;
+        }
+
+        emit(OP_RETURN);
 }
 
 void parse_statement() {
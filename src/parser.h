@@ -1,10 +1,21 @@
 #ifndef QUE_PARSER_H
 #define QUE_PARSER_H
 
+#include <que/state.h>
 #include <que/value.h>
 
-void parser_init(const char *filename, const char *source);
+/**
+ * Prepares to compile source for vm, in the execution mode set on vm. Names of
+ * globals are resolved to the vm's global slots while parsing.
+ */
+void parser_init(Que_State *vm, const char *filename, const char *source);
 
 Que_FunctionObject *parser_parse();
 
+/**
+ * Frees the memory the parser holds outside of objects when running out of
+ * memory has unwound out of parser_parse.
+ */
+void parser_unwind(void);
+
 #endif /* QUE_PARSER_H */
@@ -0,0 +1,212 @@
+#include "pool.h"
+
+#include "state_internal.h"
+
+#include <string.h>
+
+/* Slabs are requested from the state's allocator in this size */
+#define SLAB_SIZE (16 * 1024)
+
+/* The first block of a slab starts on a cache line of this size, so that
+ * blocks of classes that are multiples of it never straddle two lines */
+#define SLAB_ALIGN 64
+
+static const size_t CLASS_SIZES[QUE_POOL_CLASSES] = {
+        16, 32, 48, 64, 80, 96, 112, 128,
+        160, 192, 224, 256,
+        320, 384, 448, 512
+};
+
+/* Classes are 16 bytes apart up to 128, then 32 up to 256, then 64 */
+static size_t size_class(size_t size) {
+        size_t units = (size + 15) / 16;
+
+        if (units <= 8) {
+                return units - 1;
+        } else if (units <= 16) {
+                return 8 + (units - 9) / 2;
+        }
+
+        return 12 + (units - 17) / 4;
+}
+
+size_t pool_class_size(size_t index) {
+        return CLASS_SIZES[index];
+}
+
+void pool_init(Pool *pool) {
+        size_t i;
+
+        for (i = 0; i < QUE_POOL_CLASSES; i++) {
+                pool->classes[i].free = NULL;
+                pool->classes[i].bump = NULL;
+                pool->classes[i].bump_end = NULL;
+                pool->classes[i].slab_list = NULL;
+                pool->classes[i].used = 0;
+                pool->classes[i].capacity = 0;
+                pool->classes[i].slabs = 0;
+        }
+
+        pool->slack = 0;
+}
+
+static void *pool_alloc(Que_State *state, size_t size) {
+        size_t index = size_class(size);
+        PoolClass *pool_class = &state->pool.classes[index];
+        PoolBlock *block = pool_class->free;
+
+        if (block) {
+                pool_class->free = block->next;
+                pool_class->used++;
+                state->pool.slack -= size;
+                return block;
+        }
+
+        if (pool_class->bump == pool_class->bump_end) {
+                PoolSlab *slab = state->allocator(state->allocator_data, NULL, 0, SLAB_SIZE);
+                size_t header;
+                size_t count;
+
+                if (!slab) {
+                        return NULL;
+                }
+
+                slab->next = pool_class->slab_list;
+                pool_class->slab_list = slab;
+
+                header = SLAB_ALIGN - (size_t)slab % SLAB_ALIGN;
+                if (header < sizeof(PoolSlab)) {
+                        header += SLAB_ALIGN;
+                }
+                count = (SLAB_SIZE - header) / CLASS_SIZES[index];
+
+                pool_class->bump = (char *)slab + header;
+                pool_class->bump_end = pool_class->bump + count * CLASS_SIZES[index];
+                pool_class->capacity += count;
+                pool_class->slabs++;
+                state->pool.slack += SLAB_SIZE;
+        }
+
+        block = (PoolBlock *)pool_class->bump;
+        pool_class->bump += CLASS_SIZES[index];
+        pool_class->used++;
+        state->pool.slack -= size;
+
+        return block;
+}
+
+static void pool_free(Que_State *state, void *buf, size_t size) {
+        PoolClass *pool_class = &state->pool.classes[size_class(size)];
+        PoolBlock *block = buf;
+
+        block->next = pool_class->free;
+        pool_class->free = block;
+        pool_class->used--;
+        state->pool.slack += size;
+}
+
+void *pool_reallocate(Que_State *state, void *buf, size_t old_size, size_t new_size) {
+        int old_pooled = old_size > 0 && old_size <= POOL_MAX_SIZE;
+        int new_pooled = new_size > 0 && new_size <= POOL_MAX_SIZE;
+        void *result;
+
+        if (!old_pooled && !new_pooled) {
+                return state->allocator(state->allocator_data, buf, old_size, new_size);
+        } else if (old_pooled && new_pooled && size_class(old_size) == size_class(new_size)) {
+                /* Wraps around while growing, the block covers both sizes */
+                state->pool.slack += old_size - new_size;
+                return buf;
+        } else if (new_size == 0) {
+                pool_free(state, buf, old_size);
+                return NULL;
+        }
+
+        if (new_pooled) {
+                result = pool_alloc(state, new_size);
+        } else {
+                result = state->allocator(state->allocator_data, NULL, 0, new_size);
+        }
+
+        if (!result || !buf) {
+                return result;
+        }
+
+        memcpy(result, buf, (old_size < new_size) ? old_size : new_size);
+
+        if (old_pooled) {
+                pool_free(state, buf, old_size);
+        } else {
+                state->allocator(state->allocator_data, buf, old_size, 0);
+        }
+
+        return result;
+}
+
+size_t pool_growth(Que_State *state, size_t old_size, size_t new_size) {
+        int old_pooled = old_size > 0 && old_size <= POOL_MAX_SIZE;
+        int new_pooled = new_size > 0 && new_size <= POOL_MAX_SIZE;
+        size_t growth = 0;
+
+        if (new_pooled) {
+                PoolClass *pool_class = &state->pool.classes[size_class(new_size)];
+
+                if (old_pooled && size_class(old_size) == size_class(new_size)) {
+                        return 0;
+                } else if (!pool_class->free && pool_class->bump == pool_class->bump_end) {
+                        growth = SLAB_SIZE;
+                }
+        } else {
+                growth = new_size;
+        }
+
+        /* A pooled block that is given up stays in its slab */
+        if (!old_pooled) {
+                growth = (growth > old_size) ? growth - old_size : 0;
+        }
+
+        return growth;
+}
+
+static void free_slabs(Que_State *state, PoolClass *pool_class) {
+        PoolSlab *slab = pool_class->slab_list;
+
+        while (slab) {
+                PoolSlab *next = slab->next;
+
+                state->allocator(state->allocator_data, slab, SLAB_SIZE, 0);
+                slab = next;
+        }
+}
+
+void pool_trim(Que_State *state) {
+        size_t i;
+
+        for (i = 0; i < QUE_POOL_CLASSES; i++) {
+                PoolClass *pool_class = &state->pool.classes[i];
+
+                if (pool_class->used > 0 || pool_class->slabs == 0) {
+                        continue;
+                }
+
+                /* With no blocks in use, all of the slabs are slack */
+                free_slabs(state, pool_class);
+                state->pool.slack -= pool_class->slabs * SLAB_SIZE;
+
+                pool_class->free = NULL;
+                pool_class->bump = NULL;
+                pool_class->bump_end = NULL;
+                pool_class->slab_list = NULL;
+                pool_class->capacity = 0;
+                pool_class->slabs = 0;
+        }
+}
+
+void pool_free_all(Que_State *state) {
+        size_t i;
+
+        for (i = 0; i < QUE_POOL_CLASSES; i++) {
+                free_slabs(state, &state->pool.classes[i]);
+        }
+
+        pool_init(&state->pool);
+}
@@ -0,0 +1,85 @@
+#ifndef QUE_POOL_H
+#define QUE_POOL_H
+
+#include <que/state.h>
+
+/* Allocations of up to this many bytes are served from the pools */
+#define POOL_MAX_SIZE 512
+
+typedef struct PoolBlock {
+        struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct PoolSlab {
+        struct PoolSlab *next;
+} PoolSlab;
+
+/**
+ * One size class. Freed blocks are pushed on free, and new ones are cut from
+ * the newest slab of the class, between bump and bump_end. A state's pools
+ * are only used by the thread running that state, so nothing is locked.
+ */
+typedef struct {
+        PoolBlock *free;
+        char *bump;
+        char *bump_end;
+        PoolSlab *slab_list;
+        size_t used;
+        size_t capacity;
+        size_t slabs;
+} PoolClass;
+
+/**
+ * A freed block goes back on the free list of its class and is only reused by
+ * that class. Blocks do not know their slab, so slabs are given back a whole
+ * class at a time, once none of its blocks is used (see pool_trim).
+ *
+ * reallocate only counts the bytes it is asked for in bytes_allocated, which
+ * paces the collector. slack is what the slabs hold besides that: slab
+ * headers, the rounding up to the class size, free blocks and blocks not cut
+ * yet. Memory usage and the memory limit count both, see pool_growth.
+ */
+typedef struct {
+        PoolClass classes[QUE_POOL_CLASSES];
+        size_t slack;
+} Pool;
+
+void pool_init(Pool *pool);
+
+/**
+ * Returns the size of the blocks of class index.
+ */
+size_t pool_class_size(size_t index);
+
+/**
+ * Called by reallocate with the same arguments. Blocks of up to POOL_MAX_SIZE
+ * bytes come from the pools of state, larger ones from its allocator. The
+ * size a block is freed or resized with must be the size it was allocated
+ * with, since that is how its pool is found.
+ */
+void *pool_reallocate(Que_State *state, void *buf, size_t old_size, size_t new_size);
+
+/**
+ * Returns how much memory usage (see POOL_MEMORY_USAGE) would grow by if
+ * pool_reallocate were called with these arguments: a whole slab for a block
+ * whose class has none left, nothing for one that fits in a slab already
+ * held, and the size itself for a block from the allocator.
+ */
+size_t pool_growth(Que_State *state, size_t old_size, size_t new_size);
+
+/* The bytes state holds through reallocate, slabs counted whole */
+#define POOL_MEMORY_USAGE(state) ((state)->bytes_allocated + (state)->pool.slack)
+
+/**
+ * Gives the slabs of every class with no blocks in use back to the allocator
+ * of state. Called when a collection has finished, since that is when most
+ * blocks are freed.
+ */
+void pool_trim(Que_State *state);
+
+/**
+ * Gives every slab back to the allocator of state.
+ */
+void pool_free_all(Que_State *state);
+
+#endif /* QUE_POOL_H */
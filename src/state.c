@@ -1,29 +1,41 @@
 #include "state_internal.h"
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "gc.h"
 #include "vm.h"
 #include "opcodes.h"
 #include "parser.h"
 #include "lexer.h"
 #include "stdlib/stdlibs.h"
+#include "hash.h"
 
 #define DEFAULT_STACK_SIZE (256 * 256)
 #define DEFAULT_MAX_RECURSION 256
+#define GLOBALS_INIT_SIZE 64
+#define STRINGS_INIT_SIZE 256
 
-Que_State *Que_NewStateEx(size_t stack_size, size_t max_recursion) {
+static Que_State *new_state(size_t stack_size, size_t max_recursion, Que_Allocator allocator, void *userdata) {
         Que_State *state = NULL;
         Que_Value *stack = NULL;
         CallFrame *frames = NULL;
 
-        state = malloc(sizeof(Que_State));
+        /* These are made before the state can account for them, and failing
+         * to get them is reported instead of exiting */
+        state = allocator(userdata, NULL, 0, sizeof(Que_State));
         if (!state) {
                 goto cleanup;
         }
+        state->allocator = allocator;
+        state->allocator_data = userdata;
+        state->memory_limit = 0;
+        state->error_jump = NULL;
+        pool_init(&state->pool);
 
-        stack = malloc(sizeof(Que_Value) * stack_size);
+        stack = allocator(userdata, NULL, 0, sizeof(Que_Value) * stack_size);
         if (!stack) {
                 goto cleanup;
         }
@@ -31,47 +43,134 @@ Que_State *Que_NewStateEx(size_t stack_size, size_t max_recursion) {
         state->stack_top = state->stack;
         state->stack_size = stack_size;
 
-        frames = malloc(sizeof(CallFrame) * max_recursion);
+        frames = allocator(userdata, NULL, 0, sizeof(CallFrame) * max_recursion);
         if (!frames) {
                 goto cleanup;
         }
         state->frames = frames;
         state->frame_current = state->frames;
+        state->frame_current->func = NULL;
         state->max_recursion = max_recursion;
 
+        state->globals = NULL;
+        state->globals_allocated = 0;
+        state->globals_size = 0;
+        state->strings = NULL;
+        state->strings_capacity = 0;
+        state->strings_count = 0;
+        state->global_indices = NULL;
+        shape_tree_init(&state->shapes);
+        state->table_version = 1;
+        state->hash_seed = hash_new_seed();
+        gc_init(state);
+
+        state->globals = ALLOCATE(state, NULL, sizeof(GlobalSlot) * GLOBALS_INIT_SIZE);
+        state->globals_allocated = GLOBALS_INIT_SIZE;
+
+        state->strings = ALLOCATE(state, NULL, sizeof(Que_StringObject *) * STRINGS_INIT_SIZE);
+        memset(state->strings, 0x00, sizeof(Que_StringObject *) * STRINGS_INIT_SIZE);
+        state->strings_capacity = STRINGS_INIT_SIZE;
+
+        state->mode = QUE_MODE_STACK;
+
         /* This function can never fail so no need to check */
-        state->globals = Que_NewTable();
+        state->global_indices = Que_NewTable(state);
 
         return state;
 
 cleanup:
-        if (state) {
-                free(state);
+        if (frames) {
+                allocator(userdata, frames, sizeof(CallFrame) * max_recursion, 0);
         }
 
         if (stack) {
-                free(stack);
+                allocator(userdata, stack, sizeof(Que_Value) * stack_size, 0);
         }
 
-        if (frames) {
-                free(frames);
+        if (state) {
+                allocator(userdata, state, sizeof(Que_State), 0);
         }
 
         return NULL;
 }
 
+Que_State *Que_NewStateEx(size_t stack_size, size_t max_recursion) {
+        return new_state(stack_size, max_recursion, memory_system_allocator, NULL);
+}
+
 Que_State *Que_NewState(void) {
         return Que_NewStateEx(DEFAULT_STACK_SIZE, DEFAULT_MAX_RECURSION);
 }
 
+Que_State *Que_NewStateWithAllocator(Que_Allocator allocator, void *userdata) {
+        return new_state(DEFAULT_STACK_SIZE, DEFAULT_MAX_RECURSION, allocator, userdata);
+}
+
+void Que_SetExecutionMode(Que_State *state, Que_ExecutionMode mode) {
+        state->mode = mode;
+}
+
+void Que_SetGCStepSize(Que_State *state, size_t work) {
+        state->gc_step_size = work;
+}
+
+void Que_SetMemoryLimit(Que_State *state, size_t bytes) {
+        state->memory_limit = bytes;
+}
+
+size_t Que_GetMemoryUsage(Que_State *state) {
+        return POOL_MEMORY_USAGE(state);
+}
+
+void Que_GetPoolStats(Que_State *state, Que_PoolStats stats[QUE_POOL_CLASSES]) {
+        size_t i;
+
+        for (i = 0; i < QUE_POOL_CLASSES; i++) {
+                stats[i].size = pool_class_size(i);
+                stats[i].used = state->pool.classes[i].used;
+                stats[i].capacity = state->pool.classes[i].capacity;
+                stats[i].slabs = state->pool.classes[i].slabs;
+        }
+}
+
 void Que_DeleteState(Que_State *state) {
-        state->stack = FREE(state->stack, state->stack_size);
-        state->frames = FREE(state->frames, state->max_recursion);
-        state = FREE(state, sizeof(Que_State));
+        Que_Allocator allocator = state->allocator;
+        void *userdata = state->allocator_data;
+
+        gc_free_all(state);
+
+        state->strings = FREE(state, state->strings, sizeof(Que_StringObject *) * state->strings_capacity);
+        state->globals = FREE(state, state->globals, sizeof(GlobalSlot) * state->globals_allocated);
+        shape_tree_free(state, &state->shapes);
+        pool_free_all(state);
+
+        allocator(userdata, state->frames, sizeof(CallFrame) * state->max_recursion, 0);
+        allocator(userdata, state->stack, sizeof(Que_Value) * state->stack_size, 0);
+        allocator(userdata, state, sizeof(Que_State), 0);
 }
 
 int Que_ExecuteString(Que_State *state, const char *str) {
         Que_FunctionObject *start = NULL;
+        Que_Value *stack_top = state->stack_top;
+        CallFrame *frame_current = state->frame_current;
+        int gc_paused = state->gc_paused;
+        jmp_buf *error_jump = state->error_jump;
+        jmp_buf jump;
+        int status;
+
+        /* Running out of memory lands here, wherever the script is */
+        if (setjmp(jump) != 0) {
+                state->error_jump = error_jump;
+                state->stack_top = stack_top;
+                state->frame_current = frame_current;
+                state->gc_paused = gc_paused;
+                parser_unwind();
+                gc_unwind(state);
+
+                return QUE_ERROR_MEMORY;
+        }
+        state->error_jump = &jump;
+        gc_make_room(state);
 
         io_bootstrap(state);
 
@@ -111,23 +210,36 @@ int Que_ExecuteString(Que_State *state, const char *str) {
 #endif
 
 
-        parser_init("<user>", str);
+        /* Nothing refers to the functions being compiled until it is done */
+        gc_pause(state);
+        parser_init(state, "<user>", str);
         start = parser_parse();
 
         /* Setup the state */
         state->frame_current->func = start;
         state->frame_current->ip = start->code.code;
         state->frame_current->slots = state->stack_top;
+        gc_resume(state);
 
-        vm_execute(state);
+        if (state->mode == QUE_MODE_REGISTER) {
+                status = vm_execute_registers(state);
+        } else {
+                status = vm_execute(state);
+        }
 
-        free_obj((Que_Object *)start);
+        state->error_jump = error_jump;
+
+        if (status != 0) {
+                state->stack_top = stack_top;
+                state->frame_current = frame_current;
+                return QUE_ERROR_RUNTIME;
+        }
 
         return 0;
 }
 
 Que_Type Que_GetType(Que_State *state, int offset) {
-        return (state->stack_top + offset)->type;
+        return QUE_VALUE_TYPE(*(state->stack_top + offset));
 }
 
 Que_Type Que_GetValue(Que_State *state, Que_Value *out_value, int offset) {
@@ -179,7 +291,7 @@ int Que_AsChar(Que_State *state, int offset, char *out_char) {
         Que_Value *top = stacktop(state, offset);
 
         if (Que_IsChar(state, offset)) {
-                *out_char = top->value.c;
+                *out_char = QUE_AS_CHAR(*top);
                 return QUE_TRUE;
         }
 
@@ -190,7 +302,7 @@ int Que_AsInt(Que_State *state, int offset, Que_Int *out_int) {
         Que_Value *top = stacktop(state, offset);
 
         if (Que_IsInt(state, offset)) {
-                *out_int = top->value.i;
+                *out_int = QUE_AS_INT(*top);
                 return QUE_TRUE;
         }
         
@@ -201,7 +313,7 @@ int Que_AsFloat(Que_State *state, int offset, Que_Float *out_float) {
         Que_Value *top = stacktop(state, offset);
 
         if (Que_IsFloat(state, offset)) {
-                *out_float = top->value.f;
+                *out_float = QUE_AS_FLOAT(*top);
                 return QUE_TRUE;
         }
         
@@ -212,8 +324,11 @@ int Que_AsString(Que_State *state, int offset, char **out_str, size_t *out_lengt
         Que_Value *top = stacktop(state, offset);
 
         if (Que_IsString(state, offset)) {
-                *out_str = ((Que_StringObject *)top->value.o)->str;
-                *out_length = ((Que_StringObject *)top->value.o)->length;
+                Que_StringObject *str;
+
+                str = string_flatten(state, (Que_StringObject *)QUE_AS_OBJECT(*top));
+                *out_str = str->str;
+                *out_length = str->length;
                 return QUE_TRUE;
         }
         
@@ -253,7 +368,8 @@ void Que_PushFloat(Que_State *state, Que_Float f) {
 
 void Que_PushString(Que_State *state, const char *str) {
         Que_Value val;
-        Que_ValueString(&val, str, strlen(str));
+
+        QUE_SET_OBJECT(val, QUE_TYPE_STRING, state_intern(state, str, strlen(str)));
         stack_push(state, &val);
 }
 
@@ -263,21 +379,122 @@ void Que_PushCFunction(Que_State *state, Que_CFunction func) {
         stack_push(state, &val);
 }
 
+static void strings_insert(Que_State *state, Que_StringObject *str) {
+        size_t mask = state->strings_capacity - 1;
+        size_t index = (size_t)(str->hash & mask);
+
+        while (state->strings[index]) {
+                index = (index + 1) & mask;
+        }
+
+        state->strings[index] = str;
+}
+
+static void strings_grow(Que_State *state) {
+        Que_StringObject **old_strings = state->strings;
+        size_t old_capacity = state->strings_capacity;
+        size_t i;
+
+        state->strings = ALLOCATE(state, NULL, sizeof(Que_StringObject *) * old_capacity * 2);
+        state->strings_capacity = old_capacity * 2;
+        memset(state->strings, 0x00, sizeof(Que_StringObject *) * state->strings_capacity);
+
+        for (i = 0; i < old_capacity; i++) {
+                if (old_strings[i]) {
+                        strings_insert(state, old_strings[i]);
+                }
+        }
+
+        old_strings = FREE(state, old_strings, sizeof(Que_StringObject *) * old_capacity);
+}
+
+Que_StringObject *state_intern(Que_State *state, const char *str, size_t length) {
+        Hash hash = hash_bytes(state->hash_seed, str, length);
+        size_t mask = state->strings_capacity - 1;
+        size_t index;
+        Que_StringObject *interned;
+
+        for (index = (size_t)(hash & mask); state->strings[index]; index = (index + 1) & mask) {
+                interned = state->strings[index];
+
+                if (interned->hash == hash && interned->length == length &&
+                    memcmp(interned->str, str, length) == 0) {
+                        GC_REVIVE(state, (Que_Object *)interned);
+                        return interned;
+                }
+        }
+
+        /* The allocation may run a collection step that removes strings from
+         * the set, so the free slot found above can not be trusted */
+        interned = allocate_string(state, str, length);
+
+        /* Keep the set at most 3/4 full */
+        if (state->strings_count + 1 > state->strings_capacity / 4 * 3) {
+                strings_grow(state);
+        }
+
+        /* Only once it is in the set, which the sweep takes it out of */
+        interned->interned = QUE_TRUE;
+        strings_insert(state, interned);
+        state->strings_count++;
+
+        return interned;
+}
+
+Que_Word state_global_slot(Que_State *state, const char *name, size_t length) {
+        Que_Value key, index, *found;
+        GlobalSlot *slot;
+
+        QUE_SET_OBJECT(key, QUE_TYPE_STRING, state_intern(state, name, length));
+
+        found = Que_TableGet(state->global_indices, &key);
+        if (found) {
+                return (Que_Word)QUE_AS_INT(*found);
+        }
+
+        assert(state->globals_size <= QUE_WORD_MAX && "Too many globals");
+
+        if (state->globals_size + 1 > state->globals_allocated) {
+                state->globals = ARRAY_GROW(
+                        state,
+                        state->globals,
+                        sizeof(GlobalSlot) * state->globals_allocated,
+                        sizeof(GlobalSlot) * state->globals_allocated * 2
+                );
+                state->globals_allocated *= 2;
+        }
+
+        slot = &state->globals[state->globals_size];
+        QUE_SET_NIL(slot->value);
+        slot->name = (Que_StringObject *)QUE_AS_OBJECT(key);
+        slot->defined = QUE_FALSE;
+
+        Que_ValueInt(&index, state->globals_size);
+        Que_TableInsert(state->global_indices, &key, &index);
+
+        return (Que_Word)state->globals_size++;
+}
+
 void Que_SetGlobal(Que_State *state, int offset, const char *name) {
-        Que_Value key;
-        Que_ValueString(&key, name, strlen(name));
-        Que_TableInsert(state->globals, &key, state->stack_top + offset);
+        GlobalSlot *slot;
+
+        slot = &state->globals[state_global_slot(state, name, strlen(name))];
+
+        slot->value = *(state->stack_top + offset);
+        slot->defined = QUE_TRUE;
+        GC_BARRIER(state, &slot->value);
 }
 
 int Que_GetGlobal(Que_State *state, const char *name) {
-        Que_Value key, *val;
-        Que_ValueString(&key, name, strlen(name));
+        Que_Value key, *index;
+
+        QUE_SET_OBJECT(key, QUE_TYPE_STRING, state_intern(state, name, strlen(name)));
 
-        val = Que_TableGet(state->globals, &key);
+        index = Que_TableGet(state->global_indices, &key);
 
-        if (val) {
+        if (index && state->globals[QUE_AS_INT(*index)].defined) {
                 /* TODO: add limits check */
-                stack_push(state, val);
+                stack_push(state, &state->globals[QUE_AS_INT(*index)].value);
                 return QUE_TRUE;
         }
 
@@ -293,13 +510,18 @@ void Que_LoadTable(Que_State *state, Que_TableObject *table, const char *name) {
         Que_ValueTable(&tabval, table);
         stack_push(state, &tabval);
         Que_SetGlobal(state, -1, name);
-        /* Que_PopValue(state); */
-        /* Que_PopValue(state); */
+        stack_pop(state);
 }
 
 void Que_LoadLibrary(Que_State *state, Que_TableMethodDef *methods, const char *name) {
-        Que_TableObject *table = Que_NewTable();
+        Que_TableObject *table;
         Que_TableMethodDef *cur = methods;
+        Que_Value tabval;
+
+        /* Keep the table reachable while its keys are allocated */
+        table = Que_NewTable(state);
+        Que_ValueTable(&tabval, table);
+        stack_push(state, &tabval);
 
         for (;;) {
                 Que_Value key, method;
@@ -309,13 +531,14 @@ void Que_LoadLibrary(Que_State *state, Que_TableMethodDef *methods, const char *
                         break;
                 }
 
-                Que_ValueString(&key, cur->name, strlen(cur->name));
+                QUE_SET_OBJECT(key, QUE_TYPE_STRING, state_intern(state, cur->name, strlen(cur->name)));
                 Que_ValueCFunction(&method, cur->callback);
                 Que_TableInsert(table, &key, &method);
 
                 cur++;
         }
 
+        stack_pop(state);
         Que_LoadTable(state, table, name);
 }
 
@@ -324,17 +547,17 @@ void print_stack(Que_State *state, const char *title) {
 
         printf("Stack: %s\n", title);
         for (cur = state->stack; cur < state->stack_top; cur++) {
-                switch (cur->type) {
+                switch (QUE_VALUE_TYPE(*cur)) {
                 case QUE_TYPE_NIL:
                         puts("[nil: nil]");
                         break;
 
                 case QUE_TYPE_CHAR:
-                        printf("[char: %c]\n", cur->value.c);
+                        printf("[char: %c]\n", QUE_AS_CHAR(*cur));
                         break;
 
                 case QUE_TYPE_BOOL: {
-                        if (cur->value.b) {
+                        if (QUE_AS_BOOL(*cur)) {
                                 puts("[bool: true]");
                         } else {
                         puts("[bool: false]");
@@ -342,27 +565,27 @@ void print_stack(Que_State *state, const char *title) {
                 } break;
 
                 case QUE_TYPE_INT: {
-                        printf("[int: %lu]\n", cur->value.i);
+                        printf("[int: %lu]\n", QUE_AS_INT(*cur));
                 } break;
 
                 case QUE_TYPE_FLOAT: {
-                        printf("[float: %f]\n", cur->value.f);
+                        printf("[float: %f]\n", QUE_AS_FLOAT(*cur));
                 } break;
 
                 case QUE_TYPE_STRING: {
-                        printf("[string: %s]\n", ((Que_StringObject *)cur->value.o)->str);
+                        printf("[string: %s]\n", string_flatten(state, (Que_StringObject *)QUE_AS_OBJECT(*cur))->str);
                 } break;
 
                 case QUE_TYPE_TABLE: {
-                        printf("[table: %p]\n", (void*)cur->value.o);
+                        printf("[table: %p]\n", (void*)QUE_AS_OBJECT(*cur));
                 } break;
 
                 case QUE_TYPE_FUNCTION: {
-                        printf("[function: %p]\n", (void*)cur->value.o);
+                        printf("[function: %p]\n", (void*)QUE_AS_OBJECT(*cur));
                 } break;
 
                 case QUE_TYPE_CFUNCTION: {
-                        printf("[cfunction: %p]\n", (void*)cur->value.o);
+                        printf("[cfunction: %p]\n", (void*)QUE_AS_OBJECT(*cur));
                 } break;
                 }
         }
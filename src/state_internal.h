@@ -3,8 +3,11 @@
 
 #include <que/state.h>
 #include "memory.h"
+#include "pool.h"
+#include "table_internal.h"
 #include "value_internal.h"
 
+#include <setjmp.h>
 #include <stdio.h>
 
 typedef struct {
@@ -13,7 +16,18 @@ typedef struct {
         Que_Value *slots;
 } CallFrame;
 
+typedef struct {
+        Que_Value value;
+        Que_StringObject *name;
+        Que_Byte defined;
+} GlobalSlot;
+
 struct Que_State {
+        /* Every allocation of the state goes through this, see memory.h */
+        Que_Allocator allocator;
+        void *allocator_data;
+        Pool pool;
+
         Que_Value *stack;
         Que_Value *stack_top;
         size_t stack_size;
@@ -22,9 +36,85 @@ struct Que_State {
         CallFrame *frame_current;
         size_t max_recursion;
 
-        Que_TableObject *globals;
+        /**
+         * Globals are resolved to an index into globals when code is compiled,
+         * see state_global_slot. global_indices maps each name to its index.
+         */
+        GlobalSlot *globals;
+        size_t globals_size;
+        size_t globals_allocated;
+        Que_TableObject *global_indices;
+
+        /**
+         * Intern set, open addressed with linear probing. It does not keep its
+         * strings alive; the collector drops the ones nothing else refers to.
+         */
+        Que_StringObject **strings;
+        size_t strings_count;
+        size_t strings_capacity; /* Always a power of two */
+
+        /* Shared by the tables of this state, see Shape */
+        ShapeTree shapes;
+
+        /* The version the next table change gets, see Que_TableObject */
+        unsigned long table_version;
+
+        /* Every hash of the state is keyed with this, see hash.h */
+        Hash hash_seed;
+
+        /**
+         * Every object allocated for the state, see gc.h. bytes_allocated is
+         * all the memory the state holds through reallocate, and a collection
+         * is requested once it passes next_gc. An object has been reached in
+         * the current collection when its marked field equals gc_mark.
+         *
+         * A collection runs in steps of about gc_step_size units of work, one
+         * per object allocated, going through the phases in GcPhase. A large
+         * table can take several steps to mark, gc_cursor is where its scan
+         * stopped. While sweeping, gc_sweep points at the link to the next
+         * object to visit.
+         */
+        Que_Object *objects;
+        size_t bytes_allocated;
+        size_t next_gc;
+        Que_Byte gc_requested;
+        Que_Byte gc_mark;
+        Que_Byte gc_phase;
+        int gc_paused;
+        size_t gc_step_size;
+        Que_TableCursor gc_cursor;
+        Que_Object **gc_sweep;
+
+        Que_Object **gray;
+        size_t gray_count;
+        size_t gray_allocated;
+
+        /**
+         * Que_ExecuteString points error_jump at its own jmp_buf while a
+         * script runs. reallocate longjmps to it when the allocator fails, or
+         * when the memory usage of the state (see POOL_MEMORY_USAGE) would
+         * pass memory_limit if that is not 0.
+         * Outside of a script, the limit is not checked and a failure exits.
+         */
+        size_t memory_limit;
+        jmp_buf *error_jump;
+
+        Que_ExecutionMode mode;
 };
 
+/**
+ * Returns the index of the global called name in state->globals, adding a
+ * slot for it if there is none. A new slot is not defined until something is
+ * stored in it.
+ */
+Que_Word state_global_slot(Que_State *state, const char *name, size_t length);
+
+/**
+ * Returns the interned string with the given contents, creating it if the
+ * state does not have one yet.
+ */
+Que_StringObject *state_intern(Que_State *state, const char *str, size_t length);
+
 void print_stack(Que_State *state, const char *title);
 
 void stack_push(Que_State *state, Que_Value *val);
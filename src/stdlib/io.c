@@ -18,11 +18,11 @@ int io_print(Que_State *state, int argc) {
                 break;
 
         case QUE_TYPE_CHAR:
-                printf("%c\n", val.value.c);
+                printf("%c\n", QUE_AS_CHAR(val));
                 break;
 
         case QUE_TYPE_BOOL: {
-                if (val.value.b) {
+                if (QUE_AS_BOOL(val)) {
                         puts("true");
                 } else {
                         puts("false");
@@ -30,15 +30,15 @@ int io_print(Que_State *state, int argc) {
         } break;
 
         case QUE_TYPE_INT: {
-                printf("%lu\n", val.value.i);
+                printf("%lu\n", QUE_AS_INT(val));
         } break;
 
         case QUE_TYPE_FLOAT: {
-                printf("%f\n", val.value.f);
+                printf("%f\n", QUE_AS_FLOAT(val));
         } break;
 
         case QUE_TYPE_STRING: {
-                puts(((Que_StringObject *)(val.value.o))->str);
+                puts(string_flatten(state, (Que_StringObject *)QUE_AS_OBJECT(val))->str);
         } break;
 
         case QUE_TYPE_TABLE: {
@@ -50,7 +50,7 @@ int io_print(Que_State *state, int argc) {
         } break;
 
         case QUE_TYPE_CFUNCTION: {
-                printf("<cfunction: %p>\n", (void*)val.value.o);
+                printf("<cfunction: %p>\n", (void*)QUE_AS_OBJECT(val));
         } break;
 
         }
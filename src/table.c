@@ -1,155 +1,840 @@
-#include <que/table.h>
+#include "table_internal.h"
 
+#include "gc.h"
 #include "memory.h"
+#include "state_internal.h"
+#include "value_internal.h"
 
 #include <stdio.h>
 #include <string.h>
 
-typedef unsigned long int Hash;
+/* Large enough to take the small entries without growing again */
+#define TABLE_MIN_CAPACITY 16
+#define ARRAY_MIN_CAPACITY 8
 
-#define NUM_BUCKETS (QUE_BYTE_MAX + 1)
+/* Grow once the table would become more than 3/4 full */
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
 
-typedef struct TableEntry {
-        struct TableEntry *next;
-        Hash key;
-        Que_Value val;
-} TableEntry;
+/* How far the entry in slot index is from the slot its hash points to */
+#define PROBE_DISTANCE(table, hash, index) ((size_t)((index) - (hash)) & ((table)->capacity - 1))
 
-struct Que_TableObject {
-        QUE_OBJECT_HEAD;
+/* Each state numbers the changes of its own tables, see Que_TableObject */
+#define NEXT_VERSION(table) ((table)->state->table_version++)
 
-        TableEntry *data[NUM_BUCKETS];
-};
+static Hash hash_value(Que_TableObject *table, Que_Value *value) {
+        Hash seed = table->state->hash_seed;
+        Hash hash;
 
-/* Hash function code from:
- * https://benhoyt.com/writings/hash-table-in-c/
- */
+        /* Only the payload is hashed, a value may have padding around it */
+        switch (QUE_VALUE_TYPE(*value)) {
+        case QUE_TYPE_NIL:
+                hash = 1;
+                break;
+
+        case QUE_TYPE_CHAR:
+                hash = hash_int(seed, (Hash)(unsigned char)QUE_AS_CHAR(*value));
+                break;
+
+        case QUE_TYPE_BOOL:
+                hash = hash_int(seed, (Hash)QUE_AS_BOOL(*value) + 2);
+                break;
 
-#define FNV_OFFSET 14695981039346656037UL
-#define FNV_PRIME 1099511628211UL
+        case QUE_TYPE_INT:
+                hash = hash_int(seed, (Hash)QUE_AS_INT(*value));
+                break;
+
+        case QUE_TYPE_FLOAT: {
+                /* 0.0 and -0.0 are the same key */
+                Que_Float f = QUE_AS_FLOAT(*value) + 0.0;
+                Hash bits;
+
+                memcpy(&bits, &f, sizeof(bits));
+                hash = hash_int(seed, bits);
+        } break;
+
+        case QUE_TYPE_STRING:
+                hash = ((Que_StringObject *)QUE_AS_OBJECT(*value))->hash;
+                break;
 
-static Hash fnv_hash(const void *memory, size_t size) {
-        Hash hash = FNV_OFFSET;
-        const char *byte;
-        const char *buf = memory;
+        case QUE_TYPE_CFUNCTION: {
+                Que_CFunction func = QUE_AS_CFUNCTION(*value);
+                hash = hash_bytes(seed, &func, sizeof(func));
+        } break;
 
-        for (byte = buf; byte <= buf + size; byte++) {
-                hash ^= (Hash)(unsigned char)(*byte);
-                hash *= FNV_PRIME;
+        default:
+                hash = hash_int(seed, (Hash)(size_t)QUE_AS_OBJECT(*value));
+                break;
         }
-        return hash;
+
+        return (hash == EMPTY_HASH) ? 1 : hash;
 }
 
-static Hash hash_value(Que_Value *value) {
-        switch (value->type) {
-        /* String gets a bit of a specialization here */
-        case QUE_TYPE_STRING:
-                return fnv_hash(((Que_StringObject *)value->value.o)->str, ((Que_StringObject *)value->value.o)->length);
+static int keys_equal(Que_Value *a, Que_Value *b) {
+        if (QUE_VALUE_TYPE(*a) != QUE_VALUE_TYPE(*b)) {
+                return QUE_FALSE;
+        }
+
+        switch (QUE_VALUE_TYPE(*a)) {
+        case QUE_TYPE_NIL:
+                return QUE_TRUE;
+
+        case QUE_TYPE_CHAR:
+                return QUE_AS_CHAR(*a) == QUE_AS_CHAR(*b);
+
+        case QUE_TYPE_BOOL:
+                return QUE_AS_BOOL(*a) == QUE_AS_BOOL(*b);
+
+        case QUE_TYPE_INT:
+                return QUE_AS_INT(*a) == QUE_AS_INT(*b);
+
+        case QUE_TYPE_FLOAT:
+                return QUE_AS_FLOAT(*a) == QUE_AS_FLOAT(*b);
+
+        case QUE_TYPE_STRING: {
+                Que_StringObject *sa = (Que_StringObject *)QUE_AS_OBJECT(*a);
+                Que_StringObject *sb = (Que_StringObject *)QUE_AS_OBJECT(*b);
+
+                if (sa == sb) {
+                        return QUE_TRUE;
+                } else if (sa->interned && sb->interned) {
+                        return QUE_FALSE;
+                }
+
+                return sa->hash == sb->hash && sa->length == sb->length &&
+                        memcmp(sa->str, sb->str, sa->length) == 0;
+        }
+
+        case QUE_TYPE_CFUNCTION:
+                return QUE_AS_CFUNCTION(*a) == QUE_AS_CFUNCTION(*b);
 
         default:
-                return fnv_hash(value, sizeof(Que_Value));
+                return QUE_AS_OBJECT(*a) == QUE_AS_OBJECT(*b);
         }
 }
 
-Que_TableObject *Que_NewTable(void) {
+Que_TableObject *Que_NewTable(Que_State *state) {
         Que_TableObject *table = NULL;
 
-        table = ALLOCATE(table, sizeof(Que_TableObject));
-        memset(table->data, 0x00, sizeof(TableEntry *) * NUM_BUCKETS);
+        table = (Que_TableObject *)allocate_obj(state, sizeof(Que_TableObject), QUE_TYPE_TABLE);
+        table->state = state;
+        table->version = NEXT_VERSION(table);
+        table->shape = &state->shapes.root;
+        table->fields_allocated = 0;
+        table->fields = NULL;
+        table->array_size = 0;
+        table->array_allocated = 0;
+        table->array = NULL;
+        table->count = 0;
+        table->capacity = 0;
+        table->entries = NULL;
+        table->small = NULL;
+        table->small_allocated = 0;
 
         return table;
 }
 
-static void bucket_delete(TableEntry *bucket) {
-        TableEntry *cur = bucket;
+void table_free(Que_TableObject *table) {
+        Que_State *state = table->state;
+
+        if (table->fields) {
+                table->fields = FREE(state, table->fields, sizeof(Que_Value) * table->fields_allocated);
+        }
+
+        if (table->array) {
+                table->array = FREE(state, table->array, sizeof(Que_Value) * table->array_allocated);
+        }
+
+        if (table->entries) {
+                table->entries = FREE(state, table->entries, sizeof(TableEntry) * table->capacity);
+        }
+
+        if (table->small) {
+                table->small = FREE(state, table->small, sizeof(SmallEntry) * table->small_allocated);
+        }
+
+        table = FREE(state, table, sizeof(Que_TableObject));
+}
+
+/**
+ * Places an entry whose key is known not to be in the table yet. Richer
+ * entries (closer to their home slot) are displaced to make room for poorer
+ * ones along the way.
+ */
+static void insert_new(Que_TableObject *table, TableEntry *entry) {
+        size_t mask = table->capacity - 1;
+        size_t index = (size_t)(entry->hash & mask);
+        size_t distance = 0;
+        TableEntry carry = *entry;
 
         for (;;) {
-                TableEntry *next;
+                TableEntry *slot = &table->entries[index];
+                size_t slot_distance;
 
-                if (cur == NULL) {
-                        /* Reached end */
+                if (slot->hash == EMPTY_HASH) {
+                        GC_MOVE_BARRIER(table, &carry.key, &carry.val);
+                        *slot = carry;
                         return;
                 }
 
-                next = cur->next;
-                cur = FREE(cur, sizeof(TableEntry));
-                cur = next;
+                slot_distance = PROBE_DISTANCE(table, slot->hash, index);
+                if (slot_distance < distance) {
+                        TableEntry evicted = *slot;
+
+                        GC_MOVE_BARRIER(table, &carry.key, &carry.val);
+                        *slot = carry;
+                        carry = evicted;
+                        distance = slot_distance;
+                }
+
+                index = (index + 1) & mask;
+                distance++;
         }
 }
 
-void Que_DeleteTable(Que_TableObject *table) {
+static void table_resize(Que_TableObject *table, size_t capacity) {
+        TableEntry *old_entries = table->entries;
+        size_t old_capacity = table->capacity;
         size_t i;
-        for (i = 0; i < NUM_BUCKETS; i++) {
-                bucket_delete(table->data[i]);
+
+        table->entries = ALLOCATE(table->state, NULL, sizeof(TableEntry) * capacity);
+        table->capacity = capacity;
+        for (i = 0; i < capacity; i++) {
+                table->entries[i].hash = EMPTY_HASH;
+        }
+
+        if (old_capacity == 0) {
+                for (i = 0; i < table->count; i++) {
+                        TableEntry entry;
+
+                        entry.hash = hash_value(table, &table->small[i].key);
+                        entry.key = table->small[i].key;
+                        entry.val = table->small[i].val;
+                        insert_new(table, &entry);
+                }
+
+                if (table->small) {
+                        table->small = FREE(table->state, table->small, sizeof(SmallEntry) * table->small_allocated);
+                        table->small_allocated = 0;
+                }
+        }
+
+        for (i = 0; i < old_capacity; i++) {
+                if (old_entries[i].hash != EMPTY_HASH) {
+                        insert_new(table, &old_entries[i]);
+                }
         }
 
-        table = FREE(table, sizeof(Que_TableObject));
+        if (old_entries) {
+                old_entries = FREE(table->state, old_entries, sizeof(TableEntry) * old_capacity);
+        }
 }
 
-#define getbucket(table, hash) (table->data[hash % NUM_BUCKETS])
+static TableEntry *find_entry(Que_TableObject *table, Hash hash, Que_Value *key) {
+        size_t mask = table->capacity - 1;
+        size_t index;
+        size_t distance;
+
+        if (table->count == 0) {
+                return NULL;
+        }
+
+        for (index = (size_t)(hash & mask), distance = 0;; index = (index + 1) & mask, distance++) {
+                TableEntry *slot = &table->entries[index];
 
-static void insert_at_end(TableEntry *bucket, Hash hash, Que_Value *value) {
-        TableEntry *cur = bucket;
-        TableEntry *prev = NULL;
+                if (slot->hash == EMPTY_HASH || PROBE_DISTANCE(table, slot->hash, index) < distance) {
+                        return NULL;
+                }
+
+                if (slot->hash == hash && keys_equal(&slot->key, key)) {
+                        return slot;
+                }
+        }
+}
+
+/* Returns the index of key in table->small, or -1 */
+static long small_find(Que_TableObject *table, Que_Value *key) {
+        size_t i;
+
+        for (i = 0; i < table->count; i++) {
+                if (keys_equal(&table->small[i].key, key)) {
+                        return (long)i;
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * Takes an entry out of the hash part, shifting the entries after it back
+ * towards their home slots so that no lookup stops early at the hole.
+ */
+static void remove_entry(Que_TableObject *table, TableEntry *entry) {
+        size_t mask = table->capacity - 1;
+        size_t index = entry - table->entries;
 
         for (;;) {
-                if (!cur) {
-                        TableEntry *insert = NULL;
-
-                        insert = ALLOCATE(insert, sizeof(TableEntry));
-                        insert->key = hash;
-                        insert->val = *value;
-                        insert->next = NULL;
-                        assert(prev);
-                        prev->next = insert;
+                size_t next = (index + 1) & mask;
+                TableEntry *slot = &table->entries[next];
+
+                if (slot->hash == EMPTY_HASH || PROBE_DISTANCE(table, slot->hash, next) == 0) {
+                        break;
+                }
+
+                GC_MOVE_BARRIER(table, &slot->key, &slot->val);
+                table->entries[index] = *slot;
+                index = next;
+        }
+
+        table->entries[index].hash = EMPTY_HASH;
+        table->count--;
+}
+
+static void array_resize(Que_TableObject *table, size_t allocated) {
+        table->array = ARRAY_GROW(table->state, table->array,
+                sizeof(Que_Value) * table->array_allocated,
+                sizeof(Que_Value) * allocated);
+        table->array_allocated = allocated;
+}
+
+static void array_append(Que_TableObject *table, Que_Value *value) {
+        if (table->array_size == table->array_allocated) {
+                array_resize(table, (table->array_allocated) ? table->array_allocated * 2 : ARRAY_MIN_CAPACITY);
+        }
+
+        table->array[table->array_size++] = *value;
+}
+
+/* Moves the value of key out of the hash part, if it is there */
+static int hash_take(Que_TableObject *table, Que_Value *key, Que_Value *value) {
+        TableEntry *found;
+
+        if (table->capacity == 0) {
+                long index = small_find(table, key);
+
+                if (index < 0) {
+                        return QUE_FALSE;
+                }
+
+                /* Order does not matter, so the last entry fills the gap */
+                *value = table->small[index].val;
+                table->count--;
+                GC_MOVE_BARRIER(table, &table->small[table->count].key, &table->small[table->count].val);
+                table->small[index] = table->small[table->count];
+                return QUE_TRUE;
+        }
+
+        found = find_entry(table, hash_value(table, key), key);
+        if (!found) {
+                return QUE_FALSE;
+        }
+
+        *value = found->val;
+        remove_entry(table, found);
+        return QUE_TRUE;
+}
+
+static int hash_contains(Que_TableObject *table, Que_Value *key) {
+        if (table->capacity == 0) {
+                return small_find(table, key) >= 0;
+        }
+
+        return find_entry(table, hash_value(table, key), key) != NULL;
+}
+
+/**
+ * Appends value at key array_size, then the keys after it from the hash part.
+ * The array grows before a key is taken out of the hash part, so that a
+ * growth that runs out of memory leaves every key in the table.
+ */
+static void array_extend(Que_TableObject *table, Que_Value *value) {
+        array_append(table, value);
+
+        while (table->count > 0) {
+                Que_Value next;
+                Que_Value moved;
+
+                QUE_SET_INT(next, (Que_Int)table->array_size);
+                if (table->array_size == table->array_allocated) {
+                        if (!hash_contains(table, &next)) {
+                                break;
+                        }
+
+                        array_resize(table, table->array_allocated * 2);
+                }
+
+                if (!hash_take(table, &next, &moved)) {
+                        break;
+                }
+
+                GC_MOVE_BARRIER(table, &next, &moved);
+                table->array[table->array_size++] = moved;
+        }
+
+        table->version = NEXT_VERSION(table);
+}
+
+static void hash_insert(Que_TableObject *table, Que_Value *key, Que_Value *value) {
+        TableEntry entry;
+        TableEntry *found;
+
+        if (table->capacity == 0) {
+                long index = small_find(table, key);
+
+                if (index >= 0) {
+                        table->small[index].val = *value;
+                        return;
+                } else if (table->count < TABLE_SMALL_SIZE) {
+                        if (table->count == table->small_allocated) {
+                                size_t allocated = (table->small_allocated) ? table->small_allocated * 2 : 2;
+
+                                table->small = ARRAY_GROW(table->state, table->small,
+                                        sizeof(SmallEntry) * table->small_allocated,
+                                        sizeof(SmallEntry) * allocated);
+                                table->small_allocated = allocated;
+                        }
+
+                        table->small[table->count].key = *key;
+                        table->small[table->count].val = *value;
+                        table->count++;
+                        table->version = NEXT_VERSION(table);
                         return;
                 }
 
-                prev = cur;
-                cur = cur->next;
+                table_resize(table, TABLE_MIN_CAPACITY);
         }
+
+        entry.hash = hash_value(table, key);
+
+        /* Overwriting a value keeps it where it is, so the version stays */
+        found = find_entry(table, entry.hash, key);
+        if (found) {
+                found->val = *value;
+                return;
+        }
+
+        if (table->count + 1 > TABLE_MAX_LOAD(table->capacity)) {
+                table_resize(table, table->capacity * 2);
+        }
+
+        entry.key = *key;
+        entry.val = *value;
+        insert_new(table, &entry);
+
+        table->count++;
+        table->version = NEXT_VERSION(table);
+}
+
+/* Returns the offset of key in the fields of tables with shape, or -1 */
+static long shape_find(Shape *shape, Hash hash, Que_StringObject *key) {
+        for (; shape->key; shape = shape->parent) {
+                if (shape->hash == hash && shape->key->length == key->length &&
+                    memcmp(shape->key->str, key->str, key->length) == 0) {
+                        return (long)shape->size - 1;
+                }
+        }
+
+        return -1;
+}
+
+/* Shapes are allocated with their key copied right after them */
+#define SHAPE_SIZE(length) (sizeof(Shape) + STRING_SIZE(length))
+
+#define SHAPE_KEY(shape) ((Que_StringObject *)((shape) + 1))
+
+void shape_tree_init(ShapeTree *tree) {
+        tree->root.parent = NULL;
+        tree->root.key = NULL;
+        tree->root.hash = EMPTY_HASH;
+        tree->root.size = 0;
+        tree->transitions = NULL;
+        tree->count = 0;
+        tree->capacity = 0;
+}
+
+void shape_tree_free(Que_State *state, ShapeTree *tree) {
+        size_t i;
+
+        for (i = 0; i < tree->capacity; i++) {
+                Shape *shape = tree->transitions[i];
+
+                if (shape) {
+                        FREE(state, shape, SHAPE_SIZE(shape->key->length));
+                }
+        }
+
+        if (tree->transitions) {
+                tree->transitions = FREE(state, tree->transitions, sizeof(Shape *) * tree->capacity);
+        }
+
+        shape_tree_init(tree);
+}
+
+/* Slot of transitions where the child of parent adding a key with hash is
+ * looked for first */
+static size_t transition_home(ShapeTree *tree, Shape *parent, Hash hash) {
+        return (size_t)(hash ^ ((size_t)parent >> 4) * 2654435761UL) & (tree->capacity - 1);
+}
+
+static void transition_insert(ShapeTree *tree, Shape *shape) {
+        size_t mask = tree->capacity - 1;
+        size_t index = transition_home(tree, shape->parent, shape->hash);
+
+        while (tree->transitions[index]) {
+                index = (index + 1) & mask;
+        }
+
+        tree->transitions[index] = shape;
+}
+
+static void transitions_grow(Que_State *state, ShapeTree *tree) {
+        Shape **old_transitions = tree->transitions;
+        size_t old_capacity = tree->capacity;
+        size_t capacity = (old_capacity) ? old_capacity * 2 : TABLE_MIN_CAPACITY;
+        size_t i;
+
+        tree->transitions = ALLOCATE(state, NULL, sizeof(Shape *) * capacity);
+        tree->capacity = capacity;
+        memset(tree->transitions, 0x00, sizeof(Shape *) * capacity);
+
+        for (i = 0; i < old_capacity; i++) {
+                if (old_transitions[i]) {
+                        transition_insert(tree, old_transitions[i]);
+                }
+        }
+
+        if (old_transitions) {
+                old_transitions = FREE(state, old_transitions, sizeof(Shape *) * old_capacity);
+        }
+}
+
+/* Returns the shape of a table with shape after key is added to it */
+static Shape *shape_transition(Que_State *state, Shape *shape, Hash hash, Que_StringObject *key) {
+        ShapeTree *tree = &state->shapes;
+        Que_StringObject *copy;
+        Shape *child;
+        size_t index;
+
+        if (tree->capacity) {
+                size_t mask = tree->capacity - 1;
+
+                for (index = transition_home(tree, shape, hash); tree->transitions[index]; index = (index + 1) & mask) {
+                        child = tree->transitions[index];
+
+                        if (child->parent == shape && child->hash == hash && child->key->length == key->length &&
+                            memcmp(child->key->str, key->str, key->length) == 0) {
+                                return child;
+                        }
+                }
+        }
+
+        /* Grown before the shape is allocated, so running out of memory in
+         * either leaves nothing behind */
+        if (tree->count + 1 > TABLE_MAX_LOAD(tree->capacity)) {
+                transitions_grow(state, tree);
+        }
+
+        child = ALLOCATE(state, NULL, SHAPE_SIZE(key->length));
+        child->parent = shape;
+        child->hash = hash;
+        child->size = shape->size + 1;
+
+        /* The copy is not an object of the state and is never collected */
+        copy = SHAPE_KEY(child);
+        copy->ob_head.type = QUE_TYPE_STRING;
+        copy->ob_head.next = NULL;
+        copy->ob_head.marked = QUE_FALSE;
+        memcpy(copy->str, key->str, key->length + 1);
+        copy->length = key->length;
+        copy->hash = key->hash;
+        copy->interned = QUE_FALSE;
+        copy->rope = QUE_FALSE;
+        child->key = copy;
+
+        transition_insert(tree, child);
+        tree->count++;
+
+        return child;
+}
+
+/* Moves the fields of table into the hash part */
+static void table_drop_shape(Que_TableObject *table) {
+        Shape *shape;
+
+        for (shape = table->shape; shape->key; shape = shape->parent) {
+                Que_Value key;
+
+                QUE_SET_OBJECT(key, QUE_TYPE_STRING, shape->key);
+                GC_MOVE_BARRIER(table, &key, &table->fields[shape->size - 1]);
+                hash_insert(table, &key, &table->fields[shape->size - 1]);
+        }
+
+        if (table->fields) {
+                table->fields = FREE(table->state, table->fields, sizeof(Que_Value) * table->fields_allocated);
+        }
+
+        table->fields_allocated = 0;
+        table->shape = NULL;
+        table->version = NEXT_VERSION(table);
+}
+
+static void field_insert(Que_TableObject *table, Que_Value *key, Que_Value *value) {
+        Que_StringObject *str = (Que_StringObject *)QUE_AS_OBJECT(*key);
+        Hash hash = hash_value(table, key);
+        long index = shape_find(table->shape, hash, str);
+
+        if (index >= 0) {
+                table->fields[index] = *value;
+                return;
+        }
+
+        if (table->shape->size == SHAPE_MAX_FIELDS) {
+                table_drop_shape(table);
+                hash_insert(table, key, value);
+                return;
+        }
+
+        if (table->shape->size == table->fields_allocated) {
+                size_t allocated = (table->fields_allocated) ? table->fields_allocated * 2 : 4;
+
+                table->fields = ARRAY_GROW(table->state, table->fields,
+                        sizeof(Que_Value) * table->fields_allocated,
+                        sizeof(Que_Value) * allocated);
+                table->fields_allocated = allocated;
+        }
+
+        table->shape = shape_transition(table->state, table->shape, hash, str);
+        table->fields[table->shape->size - 1] = *value;
+        table->version = NEXT_VERSION(table);
+}
+
+/* Rope keys have no hash or characters to compare yet, so tables only ever
+ * see their flat copies */
+static Que_Value *flat_key(Que_TableObject *table, Que_Value *key, Que_Value *flat) {
+        Que_StringObject *str;
+
+        if (QUE_VALUE_TYPE(*key) != QUE_TYPE_STRING) {
+                return key;
+        }
+
+        str = (Que_StringObject *)QUE_AS_OBJECT(*key);
+        if (!str->rope) {
+                return key;
+        }
+
+        QUE_SET_OBJECT(*flat, QUE_TYPE_STRING, string_flatten(table->state, str));
+        return flat;
 }
 
 void Que_TableInsert(Que_TableObject *table, Que_Value *key, Que_Value *value) {
-        Hash hash = hash_value(key);
+        Que_Value flat;
+
+        key = flat_key(table, key, &flat);
+        gc_table_barrier(table, key, value);
+
+        if (QUE_VALUE_TYPE(*key) == QUE_TYPE_INT && QUE_AS_INT(*key) >= 0) {
+                size_t index = (size_t)QUE_AS_INT(*key);
 
-        if (!getbucket(table, hash)) {
-                getbucket(table, hash) = ALLOCATE(NULL, sizeof(TableEntry));
-                getbucket(table, hash)->key = hash;
-                getbucket(table, hash)->val = *value;
-                getbucket(table, hash)->next = NULL;
+                if (index < table->array_size) {
+                        table->array[index] = *value;
+                        return;
+                } else if (index == table->array_size) {
+                        array_extend(table, value);
+                        return;
+                }
+        } else if (QUE_VALUE_TYPE(*key) == QUE_TYPE_STRING && table->shape) {
+                field_insert(table, key, value);
                 return;
-        } else {
-                insert_at_end(getbucket(table, hash), hash, value);
         }
+
+        hash_insert(table, key, value);
 }
 
 void Que_TableQInsert(Que_TableObject *table, Que_Value *value, const char *key) {
         Que_Value str;
-        Que_ValueString(&str, key, strlen(key));
+        Que_ValueString(table->state, &str, key, strlen(key));
         Que_TableInsert(table, &str, value);
 }
 
-TableEntry *find_in_bucket(TableEntry *bucket, Hash hash) {
-        TableEntry *cur = bucket;
+Que_Value *Que_TableGet(Que_TableObject *table, Que_Value *key) {
+        TableEntry *found;
+        Que_Value flat;
 
-        for (;;) {
-                if (!cur) {
-                        return NULL;
+        key = flat_key(table, key, &flat);
+
+        if (QUE_VALUE_TYPE(*key) == QUE_TYPE_INT &&
+            QUE_AS_INT(*key) >= 0 && (size_t)QUE_AS_INT(*key) < table->array_size) {
+                return &table->array[QUE_AS_INT(*key)];
+        } else if (QUE_VALUE_TYPE(*key) == QUE_TYPE_STRING && table->shape) {
+                long index = shape_find(table->shape, hash_value(table, key), (Que_StringObject *)QUE_AS_OBJECT(*key));
+
+                return (index >= 0) ? &table->fields[index] : NULL;
+        }
+
+        if (table->count == 0) {
+                return NULL;
+        } else if (table->capacity == 0) {
+                long index = small_find(table, key);
+
+                return (index >= 0) ? &table->small[index].val : NULL;
+        }
+
+        found = find_entry(table, hash_value(table, key), key);
+
+        return (found) ? &found->val : NULL;
+}
+
+void Que_TableReserve(Que_TableObject *table, size_t array, size_t hash) {
+        if (table->array_size + array > table->array_allocated) {
+                array_resize(table, table->array_size + array);
+                table->version = NEXT_VERSION(table);
+        }
+
+        if (table->capacity > 0 || table->count + hash > TABLE_SMALL_SIZE) {
+                size_t capacity = TABLE_MIN_CAPACITY;
+
+                while (TABLE_MAX_LOAD(capacity) < table->count + hash) {
+                        capacity *= 2;
+                }
+
+                if (capacity > table->capacity) {
+                        table_resize(table, capacity);
+                        table->version = NEXT_VERSION(table);
                 }
+        }
+}
+
+/* Whether key is an int in array_size up to array_size + count */
+#define AFTER_ARRAY(table, key, count) \
+        (QUE_VALUE_TYPE(key) == QUE_TYPE_INT && QUE_AS_INT(key) >= 0 && \
+         (size_t)QUE_AS_INT(key) >= (table)->array_size && \
+         (size_t)QUE_AS_INT(key) - (table)->array_size < (count))
+
+void Que_TableInsertMany(Que_TableObject *table, Que_Value *keys, Que_Value *values, size_t count) {
+        Que_Byte *seen;
+        size_t after = 0;
+        size_t array = 0;
+        size_t strings = 0;
+        size_t hash = 0;
+        size_t i;
 
-                if (cur->key == hash) {
-                        return cur;
+        if (count == 0) {
+                return;
+        }
+
+        /* Work out which part each key will land in. Only the keys that carry
+         * on the array part without a gap go there, seen marks which of the
+         * count keys after it are there */
+        seen = ALLOCATE(table->state, NULL, count);
+        memset(seen, 0x00, count);
+
+        for (i = 0; i < count; i++) {
+                if (AFTER_ARRAY(table, keys[i], count)) {
+                        seen[(size_t)QUE_AS_INT(keys[i]) - table->array_size] = QUE_TRUE;
+                        after++;
+                } else if (QUE_VALUE_TYPE(keys[i]) == QUE_TYPE_STRING) {
+                        strings++;
+                } else if (QUE_VALUE_TYPE(keys[i]) != QUE_TYPE_INT || QUE_AS_INT(keys[i]) < 0 ||
+                           (size_t)QUE_AS_INT(keys[i]) >= table->array_size) {
+                        hash++;
                 }
+        }
+
+        while (array < count && seen[array]) {
+                array++;
+        }
+
+        seen = FREE(table->state, seen, count);
+        hash += after - array;
+
+        /* Skip the shapes a table would go through before outgrowing them */
+        if (table->shape && table->shape->size + strings > SHAPE_MAX_FIELDS) {
+                table_drop_shape(table);
+        }
+
+        if (!table->shape) {
+                hash += strings;
+        }
+
+        Que_TableReserve(table, array, hash);
 
-                cur = cur->next;
+        for (i = 0; i < count; i++) {
+                Que_TableInsert(table, &keys[i], &values[i]);
         }
 }
 
-Que_Value *Que_TableGet(Que_TableObject *table, Que_Value *key) {
-        Hash hash = hash_value(key);
-        TableEntry *bucket = getbucket(table, hash);
-        TableEntry *found = find_in_bucket(bucket, hash);
+/* Parts of a table in the order a cursor walks them */
+enum {
+        CURSOR_ARRAY,
+        CURSOR_FIELDS,
+        CURSOR_SMALL,
+        CURSOR_ENTRIES,
+        CURSOR_DONE
+};
 
-        return (found) ? &found->val : NULL;
+void Que_TableIterate(Que_TableObject *table, Que_TableCursor *cursor) {
+        cursor->table = table;
+        cursor->part = CURSOR_ARRAY;
+        cursor->index = 0;
+        cursor->shape = NULL;
+}
+
+int Que_TableNext(Que_TableCursor *cursor, Que_Value *key, Que_Value *value) {
+        Que_TableObject *table = cursor->table;
+
+        switch (cursor->part) {
+        case CURSOR_ARRAY:
+                if (cursor->index < table->array_size) {
+                        QUE_SET_INT(*key, (Que_Int)cursor->index);
+                        *value = table->array[cursor->index++];
+                        return QUE_TRUE;
+                }
+
+                cursor->part = CURSOR_FIELDS;
+                cursor->index = 0;
+                cursor->shape = table->shape;
+                /* Fall through */
+
+        case CURSOR_FIELDS: {
+                Shape *shape = cursor->shape;
+
+                /* Fields are walked from the newest key back to the first. A
+                 * table that has dropped its shape since has moved them to
+                 * the hash part */
+                if (shape && shape->key && table->shape) {
+                        QUE_SET_OBJECT(*key, QUE_TYPE_STRING, shape->key);
+                        *value = table->fields[shape->size - 1];
+                        cursor->shape = shape->parent;
+                        return QUE_TRUE;
+                }
+
+                cursor->part = CURSOR_SMALL;
+        } /* Fall through */
+
+        case CURSOR_SMALL:
+                if (table->capacity == 0 && cursor->index < table->count) {
+                        *key = table->small[cursor->index].key;
+                        *value = table->small[cursor->index++].val;
+                        return QUE_TRUE;
+                }
+
+                cursor->part = CURSOR_ENTRIES;
+                cursor->index = 0;
+                /* Fall through */
+
+        case CURSOR_ENTRIES:
+                for (; cursor->index < table->capacity; cursor->index++) {
+                        TableEntry *entry = &table->entries[cursor->index];
+
+                        if (entry->hash != EMPTY_HASH) {
+                                *key = entry->key;
+                                *value = entry->val;
+                                cursor->index++;
+                                return QUE_TRUE;
+                        }
+                }
+
+                cursor->part = CURSOR_DONE;
+        }
+
+        return QUE_FALSE;
 }
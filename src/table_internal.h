@@ -0,0 +1,127 @@
+#ifndef QUE_TABLE_INTERNAL_H
+#define QUE_TABLE_INTERNAL_H
+
+#include <que/state.h>
+#include <que/table.h>
+
+#include "hash.h"
+
+/* Hash of a slot that holds nothing, real hashes are never 0 */
+#define EMPTY_HASH 0
+
+typedef struct {
+        Hash hash;
+        Que_Value key;
+        Que_Value val;
+} TableEntry;
+
+typedef struct {
+        Que_Value key;
+        Que_Value val;
+} SmallEntry;
+
+/* Entries the hash part keeps unhashed before it allocates a hash table */
+#define TABLE_SMALL_SIZE 8
+
+/**
+ * A shape (hidden class) describes the string keys of a table and the order
+ * they were added in. Each shape is the shape before it (parent) plus one key,
+ * which is stored at fields[size - 1] in every table with the shape. Tables
+ * that get the same keys in the same order share the same shape, so a field
+ * found at an offset in one of them is at that offset in all of them.
+ *
+ * Each state has its own tree of shapes, rooted at the shape of an empty
+ * table. Shapes are allocated from the state and only freed with it. The key
+ * is a copy that is not an object of the state, stored in the same block
+ * right after the shape.
+ */
+typedef struct Shape {
+        struct Shape *parent;
+        Que_StringObject *key; /* NULL for the root */
+        Hash hash;
+        size_t size;
+} Shape;
+
+/**
+ * The shapes of a state. transitions is open addressed with linear probing
+ * and holds every shape but the root, found by its parent and key, so adding
+ * a key to a shape with many children does not scan them all.
+ */
+typedef struct {
+        Shape root;
+        Shape **transitions;
+        size_t count;
+        size_t capacity; /* Always a power of two, or 0 until the first key */
+} ShapeTree;
+
+void shape_tree_init(ShapeTree *tree);
+
+/**
+ * Frees every shape of the tree. No table may use them afterwards.
+ */
+void shape_tree_free(Que_State *state, ShapeTree *tree);
+
+/* A table that gets more string keys than this switches to the hash part */
+#define SHAPE_MAX_FIELDS 32
+
+/**
+ * String keys are fields of the table's shape while it has one. Once a table
+ * outgrows SHAPE_MAX_FIELDS its fields move to the hash part and shape
+ * becomes NULL for good.
+ *
+ * Int keys 0..array_size-1 live in the array part, a plain vector of values
+ * indexed by the key, so a table used as a list needs neither hashing nor
+ * probing. Any other key goes to the hash part. The array part never has
+ * holes: a key that would extend it by one is appended, along with any keys
+ * after it that were waiting in the hash part.
+ *
+ * The first TABLE_SMALL_SIZE entries of the hash part are kept unhashed in
+ * small, which grows along with them, and are found with a linear scan. When
+ * one more is added they are hashed into entries and small is freed.
+ * Tables that only use the array part or fields never allocate either.
+ *
+ * Once allocated, the hash part is open addressed with Robin Hood linear
+ * probing. An entry is kept at most as far from its home slot
+ * (hash & (capacity - 1)) as any entry it passed while probing, so a lookup
+ * can give up as soon as it meets an entry that is closer to home than the
+ * key being searched for would be.
+ */
+struct Que_TableObject {
+        QUE_OBJECT_HEAD;
+
+        /* Every part of the table is allocated from the state that owns it */
+        Que_State *state;
+
+        /**
+         * Changes whenever an entry is added or removed, so a Que_Value * from
+         * Que_TableGet may be reused for as long as the version stays the same.
+         * Versions are unique across the tables of a state, so a new table
+         * allocated at the address of an old one will not match a pointer
+         * cached for the old one. Each state counts its own, so states on
+         * different threads do not share the counter.
+         * Adding an entry can also move every other one when the table grows.
+         */
+        unsigned long version;
+
+        Shape *shape;
+        size_t fields_allocated;
+        Que_Value *fields;
+
+        size_t array_size;
+        size_t array_allocated;
+        Que_Value *array;
+
+        size_t count;
+        size_t capacity; /* Always a power of two, or 0 while small is in use */
+        TableEntry *entries;
+        SmallEntry *small;
+        size_t small_allocated;
+};
+
+/**
+ * Frees table and its parts. Only for free_obj, once the table has been
+ * taken out of the object list of its state.
+ */
+void table_free(Que_TableObject *table);
+
+#endif /* QUE_TABLE_INTERNAL_H */
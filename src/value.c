@@ -3,115 +3,242 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "gc.h"
+#include "hash.h"
 #include "memory.h"
-#include <que/table.h>
+#include "state_internal.h"
+#include "table_internal.h"
 #include "value_internal.h"
 
-Que_Object *allocate_obj(size_t size, Que_Type type) {
+/* Deepest a rope may get, see StringRope */
+#define ROPE_MAX_DEPTH 32
+
+Que_Object *allocate_obj(Que_State *state, size_t size, Que_Type type) {
         Que_Object *obj = NULL;
 
-        assert(size > sizeof(Que_Object));
+        assert(state && size > sizeof(Que_Object));
 
-        obj = ALLOCATE(obj, size);
-        obj->next = NULL;
-        obj->marked = QUE_FALSE;
+        obj = ALLOCATE(state, obj, size);
         obj->type = type;
+        gc_track(state, obj);
 
         return obj;
 }
 
-void free_obj(Que_Object *obj) {
+void free_obj(Que_State *state, Que_Object *obj) {
         switch (obj->type) {
         case QUE_TYPE_STRING: {
                 Que_StringObject *str = (Que_StringObject *)obj;
 
-                str->str = FREE(str->str, str->length + 1);
-                str = FREE(str, sizeof(Que_StringObject));
+                if (str->rope) {
+                        str = FREE(state, str, sizeof(StringRope));
+                } else {
+                        str = FREE(state, str, STRING_SIZE(str->length));
+                }
         } break;
 
         case QUE_TYPE_FUNCTION: {
                 Que_FunctionObject *func = (Que_FunctionObject *)obj;
 
-                free_obj((Que_Object *)func->name);
-                chunk_free(&(func->code));
+                chunk_free(state, &(func->code));
+                func = FREE(state, func, sizeof(Que_FunctionObject));
         } break;
 
         case QUE_TYPE_TABLE: {
                 Que_TableObject *tab = (Que_TableObject *)obj;
-                Que_DeleteTable(tab);
+                table_free(tab);
         } break;
 
         default: {} break;
         }
 }
 
-Que_StringObject *allocate_string(const char *str, size_t length) {
+Que_StringObject *allocate_string(Que_State *state, const char *str, size_t length) {
         Que_StringObject *obj = (Que_StringObject *)allocate_obj(
-                sizeof(Que_StringObject), QUE_TYPE_STRING
+                state, STRING_SIZE(length), QUE_TYPE_STRING
         );
 
-        obj->str = ALLOCATE(obj->str, length + 1);
-
         obj->length = length;
+        obj->interned = QUE_FALSE;
+        obj->rope = QUE_FALSE;
         memcpy(obj->str, str, length);
         obj->str[obj->length] = '\0';
+        obj->hash = hash_bytes(state->hash_seed, obj->str, obj->length);
 
         return obj;
 }
 
-Que_FunctionObject *allocate_function(Que_Value *identifier) {
+/* Copies the characters of str so that they end at end */
+static void copy_rope(Que_StringObject *str, char *end) {
+        /* Left halves are walked in a loop, only right ones recurse */
+        while (str->rope && !((StringRope *)str)->flat) {
+                StringRope *rope = (StringRope *)str;
+
+                copy_rope(rope->right, end);
+                end -= rope->right->length;
+                str = rope->left;
+        }
+
+        if (str->rope) {
+                str = ((StringRope *)str)->flat;
+        }
+
+        memcpy(end - str->length, str->str, str->length);
+}
+
+Que_StringObject *string_flatten(Que_State *state, Que_StringObject *str) {
+        StringRope *rope = (StringRope *)str;
+        Que_StringObject *flat;
+
+        if (!str->rope) {
+                return str;
+        } else if (rope->flat) {
+                return rope->flat;
+        }
+
+        /* Nothing refers to the copy until it is done */
+        gc_pause(state);
+
+        flat = (Que_StringObject *)allocate_obj(state, STRING_SIZE(str->length), QUE_TYPE_STRING);
+        flat->length = str->length;
+        flat->interned = QUE_FALSE;
+        flat->rope = QUE_FALSE;
+
+        copy_rope(str, flat->str + flat->length);
+        flat->str[flat->length] = '\0';
+        flat->hash = hash_bytes(state->hash_seed, flat->str, flat->length);
+
+        rope->hash = flat->hash;
+        rope->flat = flat;
+        rope->left = NULL;
+        rope->right = NULL;
+
+        gc_resume(state);
+
+        return flat;
+}
+
+static int rope_depth(Que_StringObject *str) {
+        return (str->rope) ? ((StringRope *)str)->depth : 0;
+}
+
+Que_StringObject *string_concat(Que_State *state, Que_StringObject *a, Que_StringObject *b) {
+        size_t length = a->length + b->length;
+        StringRope *rope;
+
+        if (a->rope && ((StringRope *)a)->flat) {
+                a = ((StringRope *)a)->flat;
+        }
+
+        if (b->rope && ((StringRope *)b)->flat) {
+                b = ((StringRope *)b)->flat;
+        }
+
+        if (a->length == 0) {
+                return b;
+        } else if (b->length == 0) {
+                return a;
+        }
+
+        /* Both are flat, since a rope is never this short */
+        if (length <= SHORT_STRING_MAX) {
+                Que_StringObject *obj = (Que_StringObject *)allocate_obj(
+                        state, STRING_SIZE(length), QUE_TYPE_STRING
+                );
+
+                obj->length = length;
+                obj->interned = QUE_FALSE;
+                obj->rope = QUE_FALSE;
+                memcpy(obj->str, a->str, a->length);
+                memcpy(obj->str + a->length, b->str, b->length);
+                obj->str[length] = '\0';
+                obj->hash = hash_bytes(state->hash_seed, obj->str, length);
+
+                return obj;
+        }
+
+        /* Prepending keeps making right halves deeper, so they are flattened
+         * once flattening the result would recurse too far */
+        if (rope_depth(b) + 1 > ROPE_MAX_DEPTH) {
+                b = string_flatten(state, b);
+        }
+
+        rope = (StringRope *)allocate_obj(state, sizeof(StringRope), QUE_TYPE_STRING);
+        rope->hash = 0;
+        rope->length = length;
+        rope->interned = QUE_FALSE;
+        rope->rope = QUE_TRUE;
+        rope->depth = (rope_depth(a) > rope_depth(b) + 1) ? rope_depth(a) : rope_depth(b) + 1;
+        rope->left = a;
+        rope->right = b;
+        rope->flat = NULL;
+
+        /* The rope is black if the collector is marking, so it would not
+         * trace its halves itself */
+        if (state->gc_phase == GC_PHASE_MARK) {
+                Que_Value half;
+
+                QUE_SET_OBJECT(half, QUE_TYPE_STRING, a);
+                gc_shade(state, &half);
+                QUE_SET_OBJECT(half, QUE_TYPE_STRING, b);
+                gc_shade(state, &half);
+        }
+
+        return (Que_StringObject *)rope;
+}
+
+Que_FunctionObject *allocate_function(Que_State *state, Que_Value *identifier) {
         Que_FunctionObject *obj = (Que_FunctionObject *)allocate_obj(
-                sizeof(Que_FunctionObject), QUE_TYPE_FUNCTION
+                state, sizeof(Que_FunctionObject), QUE_TYPE_FUNCTION
         );
 
         obj->arity = -1;
-        obj->name = (Que_StringObject *)identifier->value.o;
-        chunk_init(&(obj->code));
+        obj->registers = 0;
+        obj->name = (Que_StringObject *)QUE_AS_OBJECT(*identifier);
+        chunk_init(state, &(obj->code));
 
         return obj;
 }
 
 void Que_ValueNil(Que_Value *val) {
-        val->type = QUE_TYPE_NIL;
-        val->value.o = NULL;
+        QUE_SET_NIL(*val);
 }
 
 void Que_ValueChar(Que_Value *val, char c) {
-        val->type = QUE_TYPE_CHAR;
-        val->value.c = c;
+        QUE_SET_CHAR(*val, c);
 }
 
 void Que_ValueBool(Que_Value *val, int b) {
-        val->type = QUE_TYPE_BOOL;
-        val->value.b = b;
+        QUE_SET_BOOL(*val, b);
 }
 
 void Que_ValueInt(Que_Value *val, Que_Int i) {
-        val->type = QUE_TYPE_INT;
-        val->value.i = i;
+        QUE_SET_INT(*val, i);
 }
 
 void Que_ValueFloat(Que_Value *val, Que_Float f) {
-        val->type = QUE_TYPE_FLOAT;
-        val->value.f = f;
+#ifdef QUE_NAN_BOXING
+        /* Any NaN from the host becomes the canonical one, which is untagged */
+        if (f != f) {
+                val->bits = QUE_NAN_BOX(0);
+                return;
+        }
+#endif
+        QUE_SET_FLOAT(*val, f);
 }
 
-void Que_ValueString(Que_Value *val, const char *str, size_t len) {
-        val->type = QUE_TYPE_STRING;
-        val->value.o = (Que_Object *)allocate_string(str, len);
+void Que_ValueString(Que_State *state, Que_Value *val, const char *str, size_t len) {
+        QUE_SET_OBJECT(*val, QUE_TYPE_STRING, allocate_string(state, str, len));
 }
 
 void Que_ValueTable(Que_Value *val, struct Que_TableObject *table) {
-        val->type = QUE_TYPE_TABLE;
-        val->value.o = (Que_Object *)table;
+        QUE_SET_OBJECT(*val, QUE_TYPE_TABLE, table);
 }
 
 void Que_ValueFunction(Que_Value *val, Que_FunctionObject *func) {
-        val->type = QUE_TYPE_FUNCTION;
-        val->value.o = (Que_Object *)func;
+        QUE_SET_OBJECT(*val, QUE_TYPE_FUNCTION, func);
 }
 
 void Que_ValueCFunction(Que_Value *val, Que_CFunction callback) {
-        val->type = QUE_TYPE_CFUNCTION;
-        val->value.o = (Que_Object *)callback;
+        QUE_SET_CFUNCTION(*val, callback);
 }
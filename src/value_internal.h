@@ -2,11 +2,48 @@
 #define QUE_VALUE_INTERNAL_H
 
 #include "chunk.h"
+#include "hash.h"
 
+#include <stddef.h>
+
+/**
+ * Bytes allocated for a string of length characters. Short ones, which most
+ * identifiers and literals are, all take a SHORT_STRING_SIZE block, so they
+ * share one pool class and each fits in a cache line.
+ */
+#define SHORT_STRING_SIZE 64
+#define SHORT_STRING_MAX (SHORT_STRING_SIZE - offsetof(Que_StringObject, str) - 1)
+#define STRING_SIZE(length) ((length) <= SHORT_STRING_MAX ? \
+        SHORT_STRING_SIZE : offsetof(Que_StringObject, str) + (length) + 1)
+
+/**
+ * A string with rope set. left and right are the halves it was made of, until
+ * string_flatten copies them into flat and drops them. depth is how deep
+ * string_flatten has to recurse, which it only does for right halves.
+ */
+typedef struct {
+        QUE_OBJECT_HEAD;
+
+        Hash hash;
+        size_t length;
+        Que_Byte interned;
+        Que_Byte rope;
+        int depth;
+
+        Que_StringObject *left;
+        Que_StringObject *right;
+        Que_StringObject *flat;
+} StringRope;
+
+/**
+ * registers is how many slots a frame of the function uses in register mode,
+ * counting from the function's own slot, see registerize.
+ */
 struct Que_FunctionObject {
         QUE_OBJECT_HEAD;
 
         int arity;
+        int registers;
         Que_StringObject *name;
         Chunk code;
 };
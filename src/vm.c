@@ -1,9 +1,12 @@
 #include "vm.h"
 
+#include "gc.h"
 #include "opcodes.h"
 #include "state_internal.h"
+#include "table_internal.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 
@@ -19,21 +22,259 @@ static const char *QUE_TYPE_NAMES[] = {
         "cfunction"
 };
 
-#define GET_BYTE() (*(state->frame_current->ip++))
-
-#define GET_CONSTANT(i) (state->frame_current->func->code.constants[i])
+/**
+ * vm_execute keeps the instruction pointer, stack top, local slots and
+ * constant pool of the running frame in C locals so the compiler can hold them
+ * in registers. They are written back to the CallFrame and Que_State only
+ * where something else can observe them: calls, returns and C functions.
+ */
+#define GET_BYTE() (*ip++)
+
+#define GET_WORD() (ip += 2, (Que_Word)((ip[-2] << 8) + ip[-1]))
+
+#define GET_CONSTANT(i) (constants[i])
+
+#define GET_GLOBAL(i) (&state->globals[i])
+
+/* Looks up constant i as a key in table, through the constant's inline cache */
+#define CACHED_GET(table, i) (cached_get(&caches[i], (table), &constants[i]))
+
+#define LOAD_FRAME() \
+        (ip = frame->ip, slots = frame->slots, \
+         constants = frame->func->code.constants, caches = frame->func->code.caches)
+
+#define SAVE_FRAME() (frame->ip = ip, state->stack_top = sp)
+
+/* Debug builds check the bounds of the stack, as stack_push and stack_pop do */
+#define CHECK_PUSH() assert(sp < state->stack + state->stack_size)
+#define CHECK_POP() assert(sp > state->stack)
+
+#define PUSH(val) (CHECK_PUSH(), *sp++ = (val))
+#define POP() (CHECK_POP(), *--sp)
+#define PEEK(offset) (sp[offset])
+
+#define PUSH_NIL() (CHECK_PUSH(), QUE_SET_NIL(*sp), sp++)
+#define PUSH_BOOL(x) (CHECK_PUSH(), QUE_SET_BOOL(*sp, x), sp++)
+#define PUSH_INT(x) (CHECK_PUSH(), QUE_SET_INT(*sp, x), sp++)
+#define PUSH_FLOAT(x) (CHECK_PUSH(), QUE_SET_FLOAT(*sp, x), sp++)
+
+#define IS_ARITHMETIC(val) (QUE_VALUE_TYPE(val) == QUE_TYPE_INT || QUE_VALUE_TYPE(val) == QUE_TYPE_FLOAT)
+
+#define AS_ARITHMETIC(val) ((QUE_VALUE_TYPE(val) == QUE_TYPE_INT) ? (QUE_AS_INT(val)) : (QUE_AS_FLOAT(val)))
+
+/**
+ * The interpreter loop is written in terms of the VM_* macros so that it can
+ * be dispatched in one of two ways. With QUE_COMPUTED_GOTO (see common.h) every
+ * handler ends by jumping directly to the handler of the next instruction
+ * through a label table generated from opcodes.txt, which gives the branch
+ * predictor one indirect jump per handler to learn from. Without it, a
+ * portable switch statement is used. Both execute the same bytecode the same
+ * way.
+ */
+#ifdef QUE_DEBUG_STACK
+#        define VM_TRACE() (state->stack_top = sp, print_stack(state, OPCODE_NAMES[ins]))
+#else
+#        define VM_TRACE() ((void)0)
+#endif
+
+/**
+ * QUE_DEBUG_OPCODE_PAIRS counts how often each opcode is executed directly
+ * after each other one, and prints the most frequent pairs when a script
+ * finishes. Pairs are counted after the peephole pass, so the sequences it
+ * fuses no longer show up.
+ *
+ * The superinstructions in opcodes.txt were picked from library.que,
+ * locals.que and numeric.que in bench/corpus, which run straight through a
+ * few dozen instructions each. The loop and call heavy calls.que and
+ * loops.que back GET_LOCAL GET_LOCAL, the start of OP_ADD_LOCALS and
+ * OP_MULTIPLY_LOCALS, as one of the three most frequent pairs. Their most
+ * frequent ones are call and return glue, such as GET_LOCAL CALL, SET_GLOBAL
+ * POP and POP PUSH_NIL RETURN, which nothing fuses yet.
+ */
+#ifdef QUE_DEBUG_OPCODE_PAIRS
+#        define OPCODE_PAIRS_SHOWN 24
+
+static unsigned long opcode_pairs[QUE_BYTE_MAX + 1][QUE_BYTE_MAX + 1];
+static Que_Byte previous_ins = OP_HALT;
+
+#        define VM_COUNT_PAIR() (opcode_pairs[previous_ins][ins]++, previous_ins = ins)
+
+static void dump_opcode_pairs(void) {
+        int shown;
+
+        fprintf(stderr, "Most frequent opcode pairs:\n");
+        for (shown = 0; shown < OPCODE_PAIRS_SHOWN; shown++) {
+                unsigned long best = 0;
+                int first = 0, second = 0;
+                int i, j;
+
+                for (i = 0; i <= QUE_BYTE_MAX; i++) {
+                        for (j = 0; j <= QUE_BYTE_MAX; j++) {
+                                if (opcode_pairs[i][j] > best) {
+                                        best = opcode_pairs[i][j];
+                                        first = i;
+                                        second = j;
+                                }
+                        }
+                }
 
-#define IS_ARITHMETIC(val) (val.type == QUE_TYPE_INT || val.type == QUE_TYPE_FLOAT)
+                if (best == 0) {
+                        break;
+                }
 
-#define AS_ARITHMETIC(val) ((val.type == QUE_TYPE_INT) ? (val.value.i) : (val.value.f))
+                fprintf(stderr, "%10lu  %s -> %s\n", best, OPCODE_NAMES[first], OPCODE_NAMES[second]);
+                opcode_pairs[first][second] = 0;
+        }
+}
+#else
+#        define VM_COUNT_PAIR() ((void)0)
+#endif
+
+#define VM_FETCH() (ins = GET_BYTE(), VM_COUNT_PAIR(), VM_TRACE())
+
+#ifdef QUE_COMPUTED_GOTO
+#        define VM_SWITCH(ins) __extension__ ({ goto *dispatch_table[ins]; });
+#        define VM_CASE(op) VM_LABEL_##op:
+#        define VM_DEFAULT
+#        define VM_BREAK __extension__ ({ VM_FETCH(); goto *dispatch_table[ins]; })
+#else
+#        define VM_SWITCH(ins) switch (ins)
+#        define VM_CASE(op) case op:
+#        define VM_DEFAULT default:
+#        define VM_BREAK break
+#endif
+
+/**
+ * Marks where an OP_BYTE handler continues once arg is read, so OP_WIDE can
+ * jump there with a word sized arg instead.
+ */
+#define VM_WIDE(op) VM_WIDE_##op:
+
+/**
+ * Stores lhs <op> rhs for two int or float operands in dst, or reports an
+ * error and leaves the interpreter loop. dst may be the same value as lhs or
+ * rhs.
+ */
+#define ARITHMETIC_TO(dst, lhs, rhs, op, symbol) do { \
+        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) { \
+                QUE_SET_INT(dst, QUE_AS_INT(lhs) op QUE_AS_INT(rhs)); \
+        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) { \
+                Que_Float l, r; \
+\
+                l = AS_ARITHMETIC(lhs); \
+                r = AS_ARITHMETIC(rhs); \
+\
+                QUE_SET_FLOAT(dst, l op r); \
+        } else { \
+                error( \
+                        "Invalid operands '%s' and '%s' for operator '" symbol "'", \
+                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], \
+                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)] \
+                ); \
+                return -1; \
+        } \
+} while (0)
+
+/**
+ * Pushes lhs <op> rhs, see ARITHMETIC_TO. Shared by the plain arithmetic
+ * opcodes and the superinstructions built on them.
+ */
+#define ARITHMETIC(lhs, rhs, op, symbol) do { \
+        ARITHMETIC_TO(*sp, lhs, rhs, op, symbol); \
+        sp++; \
+} while (0)
+
+/**
+ * Stores lhs <op> rhs for two int operands in dst, or reports an error and
+ * leaves the interpreter loop.
+ */
+#define INTEGER_ARITHMETIC_TO(dst, lhs, rhs, op, symbol) do { \
+        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) { \
+                Que_Int l, r; \
+\
+                l = QUE_AS_INT(lhs); \
+                r = QUE_AS_INT(rhs); \
+\
+                QUE_SET_INT(dst, l op r); \
+        } else { \
+                error( \
+                        "Invalid operands '%s' and '%s' for operator '" symbol "'", \
+                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], \
+                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)] \
+                ); \
+                return -1; \
+        } \
+} while (0)
+
+#define BOTH_TYPE(type, lhs, rhs) \
+        (QUE_VALUE_TYPE(lhs) == (type) && QUE_VALUE_TYPE(rhs) == (type))
+
+/**
+ * Reports an int divided by the int 0, which would trap, and leaves the
+ * interpreter loop. Dividing floats by 0 gives an infinity or NaN instead.
+ */
+#define CHECK_DIVISOR(lhs, rhs) do { \
+        if (BOTH_TYPE(QUE_TYPE_INT, lhs, rhs) && QUE_AS_INT(rhs) == 0) { \
+                error("Division by zero"); \
+                return -1; \
+        } \
+} while (0)
+
+/* lhs followed by rhs, for two string operands. Allocates, so both have to
+ * be reachable by the collector */
+#define CONCAT(lhs, rhs) string_concat( \
+        state, \
+        (Que_StringObject *)QUE_AS_OBJECT(lhs), \
+        (Que_StringObject *)QUE_AS_OBJECT(rhs) \
+)
+
+/**
+ * Quickening: the first time a generic arithmetic instruction runs, it
+ * rewrites its opcode at code to the _II or _FF form if both operands are ints
+ * or both are floats. The specialised handler only has to check that guard.
+ * When the guard fails it rewrites the opcode back with DEOPTIMIZE and runs
+ * the instruction again, so the generic handler can pick a new form.
+ */
+#define QUICKEN(code, lhs, rhs, int_op, float_op) do { \
+        if (BOTH_TYPE(QUE_TYPE_INT, lhs, rhs)) { \
+                *(code) = (int_op); \
+        } else if (BOTH_TYPE(QUE_TYPE_FLOAT, lhs, rhs)) { \
+                *(code) = (float_op); \
+        } \
+} while (0)
+
+#define DEOPTIMIZE(code, generic) (*(code) = (generic), ip = (code))
+
+/* Body of a specialised binary operator on the top two stack values */
+#define QUICK_STACK(type, set, as, op, generic) do { \
+        if (BOTH_TYPE(type, sp[-2], sp[-1])) { \
+                set(sp[-2], as(sp[-2]) op as(sp[-1])); \
+                sp--; \
+        } else { \
+                DEOPTIMIZE(ip - 1, generic); \
+        } \
+} while (0)
+
+/* Body of a specialised binary operator on two locals */
+#define QUICK_LOCALS(type, set, as, op, generic) do { \
+        Que_Byte a = GET_BYTE(); \
+        Que_Byte b = GET_BYTE(); \
+\
+        if (BOTH_TYPE(type, slots[a], slots[b])) { \
+                set(*sp, as(slots[a]) op as(slots[b])); \
+                sp++; \
+        } else { \
+                DEOPTIMIZE(ip - 3, generic); \
+        } \
+} while (0)
 
 static int value_is_truthy(Que_Value *v) {
-        switch (v->type) {
+        switch (QUE_VALUE_TYPE(*v)) {
         case QUE_TYPE_NIL: return QUE_FALSE;
         case QUE_TYPE_CHAR: return QUE_TRUE;
-        case QUE_TYPE_BOOL: return v->value.b;
-        case QUE_TYPE_INT: return (v->value.i) ? QUE_TRUE : QUE_FALSE;
-        case QUE_TYPE_FLOAT: return (v->value.f) ? QUE_TRUE : QUE_FALSE;
+        case QUE_TYPE_BOOL: return QUE_AS_BOOL(*v);
+        case QUE_TYPE_INT: return (QUE_AS_INT(*v)) ? QUE_TRUE : QUE_FALSE;
+        case QUE_TYPE_FLOAT: return (QUE_AS_FLOAT(*v)) ? QUE_TRUE : QUE_FALSE;
         case QUE_TYPE_STRING: return QUE_TRUE;
         case QUE_TYPE_TABLE: return QUE_TRUE;
         case QUE_TYPE_FUNCTION: return QUE_TRUE;
@@ -41,13 +282,26 @@ static int value_is_truthy(Que_Value *v) {
         }
 }
 
-static Que_Word get_word(Que_State *state) {
-        Que_Byte upper, lower;
+static Que_Value *cached_get(InlineCache *cache, Que_TableObject *table, Que_Value *key) {
+        Que_Value *value;
 
-        upper = GET_BYTE();
-        lower = GET_BYTE();
+        if (table->shape && cache->shape == table->shape) {
+                return &table->fields[cache->index];
+        } else if (cache->table == table && cache->version == table->version) {
+                return cache->value;
+        }
+
+        value = Que_TableGet(table, key);
+        if (value && table->shape) {
+                cache->shape = table->shape;
+                cache->index = value - table->fields;
+        } else if (value) {
+                cache->table = table;
+                cache->version = table->version;
+                cache->value = value;
+        }
 
-        return (upper << 8) + lower;
+        return value;
 }
 
 static void error(const char *format, ...) {
@@ -63,169 +317,159 @@ static void error(const char *format, ...) {
 }
 
 int vm_execute(Que_State *state) {
+        Que_Byte ins;
+
+        /* The hot interpreter state is kept in locals, see SAVE_FRAME() */
+        CallFrame *frame = state->frame_current;
+        Que_Byte *ip;
+        Que_Value *sp = state->stack_top;
+        Que_Value *slots;
+        Que_Value *constants;
+        InlineCache *caches;
+        Que_Word arg;
+
+#ifdef QUE_COMPUTED_GOTO
+        static void *dispatch_table[] = {
+#define OP(name) __extension__ &&VM_LABEL_##name
+#define OP_BYTE(name) __extension__ &&VM_LABEL_##name
+#define OP_BYTE2(name) __extension__ &&VM_LABEL_##name
+#define OP_ARG(name) __extension__ &&VM_LABEL_##name
+#include "opcodes.txt"
+#undef OP
+#undef OP_BYTE
+#undef OP_BYTE2
+#undef OP_ARG
+        };
+#endif
+
+        LOAD_FRAME();
+
         for (;;) {
-                Que_Byte ins = GET_BYTE();
+                VM_FETCH();
 
-                switch (ins) {
-                case OP_PUSH: {
-                        Que_Word addr = get_word(state);
-                        Que_Value value = GET_CONSTANT(addr);
-                        stack_push(state, &value);
-                } break;
+                VM_SWITCH(ins) {
+                VM_CASE(OP_PUSH) {
+                        arg = GET_BYTE();
+                VM_WIDE(OP_PUSH)
+                        PUSH(GET_CONSTANT(arg));
+                } VM_BREAK;
 
-                case OP_PUSH_TRUE: {
-                        Que_PushBool(state, QUE_TRUE);
-                } break;
+                VM_CASE(OP_PUSH_TRUE) {
+                        PUSH_BOOL(QUE_TRUE);
+                } VM_BREAK;
 
-                case OP_PUSH_FALSE: {
-                        Que_PushBool(state, QUE_FALSE);
-                } break;
+                VM_CASE(OP_PUSH_FALSE) {
+                        PUSH_BOOL(QUE_FALSE);
+                } VM_BREAK;
 
-                case OP_PUSH_NIL: {
-                        Que_PushNil(state);
-                } break;
+                VM_CASE(OP_PUSH_NIL) {
+                        PUSH_NIL();
+                } VM_BREAK;
 
-                case OP_POP: {
-                        stack_pop(state);
-                } break;
+                VM_CASE(OP_POP) {
+                        sp--;
+                } VM_BREAK;
 
-                case OP_ADD: {
+                VM_CASE(OP_ADD) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
-
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
-                                Que_Int l, r;
-
-                                l = lhs.value.i;
-                                r = rhs.value.i;
-
-                                Que_PushInt(state, l + r);
-
-                        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
-                                Que_Float l, r;
-
-                                l = AS_ARITHMETIC(lhs);
-                                r = AS_ARITHMETIC(rhs);
-
-                                Que_PushFloat(state, l + r);
+                        if (BOTH_TYPE(QUE_TYPE_STRING, sp[-2], sp[-1])) {
+                                /* The operands stay on the stack until the
+                                 * result has been allocated */
+                                SAVE_FRAME();
+                                QUE_SET_OBJECT(sp[-2], QUE_TYPE_STRING, CONCAT(sp[-2], sp[-1]));
+                                sp--;
                         } else {
-                                error(
-                                        "Invalid operands '%s' and '%s' for operator '+'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
-                                );
-                                return -1;
-                        }
-                } break;
+                                rhs = POP();
+                                lhs = POP();
 
-                case OP_SUBTRACT: {
-                        Que_Value lhs, rhs;
+                                QUICKEN(ip - 1, lhs, rhs, OP_ADD_II, OP_ADD_FF);
+                                ARITHMETIC(lhs, rhs, +, "+");
+                        }
+                } VM_BREAK;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                VM_CASE(OP_ADD_II) {
+                        QUICK_STACK(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, +, OP_ADD);
+                } VM_BREAK;
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
-                                Que_Int l, r;
+                VM_CASE(OP_ADD_FF) {
+                        QUICK_STACK(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, +, OP_ADD);
+                } VM_BREAK;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                VM_CASE(OP_SUBTRACT) {
+                        Que_Value lhs, rhs;
 
-                                Que_PushInt(state, l - r);
+                        rhs = POP();
+                        lhs = POP();
 
-                        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
-                                Que_Float l, r;
+                        QUICKEN(ip - 1, lhs, rhs, OP_SUBTRACT_II, OP_SUBTRACT_FF);
+                        ARITHMETIC(lhs, rhs, -, "-");
+                } VM_BREAK;
 
-                                l = AS_ARITHMETIC(lhs);
-                                r = AS_ARITHMETIC(rhs);
+                VM_CASE(OP_SUBTRACT_II) {
+                        QUICK_STACK(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, -, OP_SUBTRACT);
+                } VM_BREAK;
 
-                                Que_PushFloat(state, l - r);
-                        } else {
-                                error(
-                                        "Invalid operands '%s' and '%s' for operator '-'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
-                                );
-                                return -1;
-                        }
-                } break;
+                VM_CASE(OP_SUBTRACT_FF) {
+                        QUICK_STACK(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, -, OP_SUBTRACT);
+                } VM_BREAK;
 
-                case OP_MULTIPLY: {
+                VM_CASE(OP_MULTIPLY) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
-                                Que_Int l, r;
-
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                        QUICKEN(ip - 1, lhs, rhs, OP_MULTIPLY_II, OP_MULTIPLY_FF);
+                        ARITHMETIC(lhs, rhs, *, "*");
+                } VM_BREAK;
 
-                                Que_PushInt(state, l * r);
+                VM_CASE(OP_MULTIPLY_II) {
+                        QUICK_STACK(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, *, OP_MULTIPLY);
+                } VM_BREAK;
 
-                        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
-                                Que_Float l, r;
-
-                                l = AS_ARITHMETIC(lhs);
-                                r = AS_ARITHMETIC(rhs);
-
-                                Que_PushFloat(state, l * r);
-                        } else {
-                                error(
-                                        "Invalid operands '%s' and '%s' for operator '*'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
-                                );
-                                return -1;
-                        }
-                } break;
+                VM_CASE(OP_MULTIPLY_FF) {
+                        QUICK_STACK(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, *, OP_MULTIPLY);
+                } VM_BREAK;
 
-                case OP_DIVIDE: {
+                VM_CASE(OP_DIVIDE) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
-                                Que_Int l, r;
-
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                        CHECK_DIVISOR(lhs, rhs);
+                        QUICKEN(ip - 1, lhs, rhs, OP_DIVIDE_II, OP_DIVIDE_FF);
+                        ARITHMETIC(lhs, rhs, /, "/");
+                } VM_BREAK;
 
-                                Que_PushInt(state, l / r);
-
-                        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
-                                Que_Float l, r;
-
-                                l = AS_ARITHMETIC(lhs);
-                                r = AS_ARITHMETIC(rhs);
-
-                                Que_PushFloat(state, l / r);
+                VM_CASE(OP_DIVIDE_II) {
+                        /* A zero divisor fails the guard, so that OP_DIVIDE
+                         * reports it */
+                        if (QUE_VALUE_TYPE(sp[-1]) == QUE_TYPE_INT && QUE_AS_INT(sp[-1]) == 0) {
+                                DEOPTIMIZE(ip - 1, OP_DIVIDE);
                         } else {
-                                error(
-                                        "Invalid operands '%s' and '%s' for operator '/'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
-                                );
-                                return -1;
+                                QUICK_STACK(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, /, OP_DIVIDE);
                         }
-                } break;
+                } VM_BREAK;
+
+                VM_CASE(OP_DIVIDE_FF) {
+                        QUICK_STACK(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, /, OP_DIVIDE);
+                } VM_BREAK;
 
-                case OP_POW: {
+                VM_CASE(OP_POW) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, powl(l, r));
+                                PUSH_INT(powl(l, r));
 
                         } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
                                 Que_Float l, r;
@@ -233,354 +477,846 @@ int vm_execute(Que_State *state) {
                                 l = AS_ARITHMETIC(lhs);
                                 r = AS_ARITHMETIC(rhs);
 
-                                Que_PushFloat(state, pow(l, r));
+                                PUSH_FLOAT(pow(l, r));
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '**'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_NEGATE: {
+                VM_CASE(OP_NEGATE) {
                         Que_Value v;
 
-                        v = *stack_pop(state);
+                        v = POP();
 
-                        if (v.type == QUE_TYPE_INT) {
-                                Que_PushInt(state, -v.value.i);
+                        if (QUE_VALUE_TYPE(v) == QUE_TYPE_INT) {
+                                PUSH_INT(-QUE_AS_INT(v));
                         } else if (IS_ARITHMETIC(v)) {
-                                Que_PushFloat(state, -AS_ARITHMETIC(v));
+                                PUSH_FLOAT(-AS_ARITHMETIC(v));
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_BAND: {
+                VM_CASE(OP_BAND) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, l & r);
+                                PUSH_INT(l & r);
 
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '&'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_BOR: {
+                VM_CASE(OP_BOR) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, l | r);
+                                PUSH_INT(l | r);
 
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '|'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_BXOR: {
+                VM_CASE(OP_BXOR) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, l ^ r);
+                                PUSH_INT(l ^ r);
 
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '^'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_LSHIFT: {
+                VM_CASE(OP_LSHIFT) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, l << r);
+                                PUSH_INT(l << r);
 
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '<<'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_RSHIFT: {
+                VM_CASE(OP_RSHIFT) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        if (lhs.type == QUE_TYPE_INT && rhs.type == QUE_TYPE_INT) {
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
                                 Que_Int l, r;
 
-                                l = lhs.value.i;
-                                r = rhs.value.i;
+                                l = QUE_AS_INT(lhs);
+                                r = QUE_AS_INT(rhs);
 
-                                Que_PushInt(state, l & r);
+                                PUSH_INT(l >> r);
 
                         } else {
                                 error(
                                         "Invalid operands '%s' and '%s' for operator '>>'", 
-                                        QUE_TYPE_NAMES[lhs.type], 
-                                        QUE_TYPE_NAMES[rhs.type]
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)], 
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
                                 );
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_BNOT: {
+                VM_CASE(OP_BNOT) {
                         Que_Value val;
-                        Que_Int i;
 
-                        val = *stack_pop(state);
+                        val = POP();
 
-                        if (Que_AsInt(state, 0, &i)) {
-                                Que_PushInt(state, ~i);
+                        if (QUE_VALUE_TYPE(val) == QUE_TYPE_INT) {
+                                PUSH_INT(~QUE_AS_INT(val));
                         } else {
-                                error("Invalid operands '%s' for operator '~'", QUE_TYPE_NAMES[val.type]);
+                                error("Invalid operands '%s' for operator '~'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(val)]);
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_AND: {
+                VM_CASE(OP_AND) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        Que_PushBool(state, 
+                        PUSH_BOOL(
                                 value_is_truthy(&lhs) && value_is_truthy(&rhs)
                         );
-                } break;
+                } VM_BREAK;
 
-                case OP_OR: {
+                VM_CASE(OP_OR) {
                         Que_Value lhs, rhs;
 
-                        rhs = *stack_pop(state);
-                        lhs = *stack_pop(state);
+                        rhs = POP();
+                        lhs = POP();
 
-                        Que_PushBool(state, 
+                        PUSH_BOOL(
                                 value_is_truthy(&lhs) || value_is_truthy(&rhs)
                         );
-                } break;
+                } VM_BREAK;
 
-                case OP_NOT: {
+                VM_CASE(OP_NOT) {
                         Que_Value val;
 
-                        val = *stack_pop(state);
+                        val = POP();
 
-                        Que_PushBool(state, 
-                                value_is_truthy(&val)
+                        PUSH_BOOL(
+                                !value_is_truthy(&val)
                         );
-                } break;
+                } VM_BREAK;
 
-                case OP_DEFINE_GLOBAL: {
-                        Que_Word addr = get_word(state);
-                        Que_Value key = GET_CONSTANT(addr);
-                        Que_Value *value = stack_pop(state);
+                VM_CASE(OP_DEFINE_GLOBAL) {
+                        Que_Word addr = GET_WORD();
+                        GlobalSlot *global = GET_GLOBAL(addr);
 			
-                        Que_TableInsert(state->globals, &key, value);
-                } break;
-
-                case OP_GET_GLOBAL: {
-                        Que_Word addr = get_word(state);
-                        Que_Value key = GET_CONSTANT(addr);
-                        Que_Value *value = Que_TableGet(state->globals, &key);
-                        if (value) {
-                                stack_push(state, value);
+                        global->value = POP();
+                        global->defined = QUE_TRUE;
+                        GC_BARRIER(state, &global->value);
+                } VM_BREAK;
+
+                VM_CASE(OP_GET_GLOBAL) {
+                        GlobalSlot *global;
+
+                        arg = GET_BYTE();
+                VM_WIDE(OP_GET_GLOBAL)
+                        global = GET_GLOBAL(arg);
+                        if (global->defined) {
+                                PUSH(global->value);
                         } else {
-                                error("Global variable '%s' does not exist", ((Que_StringObject *)key.value.o)->str);
+                                error("Global variable '%s' does not exist", global->name->str);
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_SET_GLOBAL: {
-                        Que_Word addr = get_word(state);
-                        Que_Value key = GET_CONSTANT(addr);
-                        Que_Value value = *stack_peek(state, -1);
-                        Que_Value *existing;
+                VM_CASE(OP_SET_GLOBAL) {
+                        Que_Word addr = GET_WORD();
+                        GlobalSlot *global = GET_GLOBAL(addr);
 
-                        /* See if it is in the table or not */
-                        existing = Que_TableGet(state->globals, &key);
-                        if (existing) {
-                                /* We already have it */
-                                *existing = value;
-                        } else {
-			        assert(0 && "Attempt to set nonexistent global");
-                                Que_TableInsert(state->globals, &key, &value);
-                        }
-                } break;
+			assert(global->defined && "Attempt to set nonexistent global");
+                        global->value = PEEK(-1);
+                        global->defined = QUE_TRUE;
+                        GC_BARRIER(state, &global->value);
+                } VM_BREAK;
 
-                case OP_SET_LOCAL: {
-                        Que_Word slot = get_word(state);
-                        Que_Value *local = &(state->frame_current->slots[slot]);
-                        Que_Value set_to = *stack_peek(state, -1);
-                        *local = set_to;
-                } break;
+                VM_CASE(OP_SET_LOCAL) {
+                        arg = GET_BYTE();
+                VM_WIDE(OP_SET_LOCAL)
+                        slots[arg] = PEEK(-1);
+                } VM_BREAK;
 
-                case OP_GET_LOCAL: {
-                        Que_Word slot = get_word(state);
-                        Que_Value *local = &(state->frame_current->slots[slot]);
-                        stack_push(state, local);
-                } break;
+                VM_CASE(OP_GET_LOCAL) {
+                        arg = GET_BYTE();
+                VM_WIDE(OP_GET_LOCAL)
+                        PUSH(slots[arg]);
+                } VM_BREAK;
 
 
-                case OP_CALL: {
-                        Que_Word args = get_word(state);
+                VM_CASE(OP_CALL) {
+                        Que_Word args;
                         Que_Value *value;
 
-                        /* Might need -1 */
-                        value = (state->stack_top - args - 1);
+                        arg = GET_BYTE();
+                VM_WIDE(OP_CALL)
+                        args = arg;
+                        value = sp - args - 1;
 
-                        if (value->type == QUE_TYPE_CFUNCTION) {
+                        if (QUE_VALUE_TYPE(*value) == QUE_TYPE_CFUNCTION) {
                                 int ret;
-                                int i;
-                                Que_CFunction cfunc = (Que_CFunction)value->value.o;
-                                Que_Value *retval;
+                                Que_CFunction cfunc = QUE_AS_CFUNCTION(*value);
+                                Que_Value retval;
 
+                                /* C functions work on the state's stack */
+                                SAVE_FRAME();
                                 ret = cfunc(state, args);
+                                sp = state->stack_top;
 
                                 if (ret != 0) {
-                                        Que_Value errorstr = *(state->stack_top - 2);
-                                        error("%s", ((Que_StringObject *)errorstr.value.o)->str);
+                                        Que_Value errorstr = sp[-2];
+                                        error("%s", string_flatten(state, (Que_StringObject *)QUE_AS_OBJECT(errorstr))->str);
 
                                         return ret;
                                 }
 
-                                retval = stack_pop(state);
-
-                                /* Pop args */
-                                for (i = 0; i < args; i++) {
-                                        stack_pop(state);
-                                }
+                                retval = POP();
 
-                                stack_pop(state); /* Function value itself */
-                                stack_push(state, retval); /* Function return value in it's place */
+                                sp -= args; /* Pop args */
+                                sp--; /* Function value itself */
+                                PUSH(retval); /* Function return value in it's place */
 
-                        } else if (value->type == QUE_TYPE_FUNCTION) {
-                                Que_FunctionObject *func = ((Que_FunctionObject *)(state->stack_top - args - 1)->value.o);
+                        } else if (QUE_VALUE_TYPE(*value) == QUE_TYPE_FUNCTION) {
+                                Que_FunctionObject *func = (Que_FunctionObject *)QUE_AS_OBJECT(*value);
                                 assert(func->ob_head.type == QUE_TYPE_FUNCTION);
 
-                                state->frame_current++;
-                                assert(state->frame_current <= state->frames + state->max_recursion);
-                                state->frame_current->func = func;
-                                state->frame_current->ip = func->code.code;
-                                state->frame_current->slots = state->stack_top - args - 1;
+                                frame->ip = ip;
+                                frame++;
+                                assert(frame < state->frames + state->max_recursion);
+                                frame->func = func;
+                                frame->ip = func->code.code;
+                                frame->slots = value;
+                                state->frame_current = frame;
+                                LOAD_FRAME();
                         } else {
-                                error("Object type '%s' is not a function", QUE_TYPE_NAMES[value->type]);
+                                error("Object type '%s' is not a function", QUE_TYPE_NAMES[QUE_VALUE_TYPE(*value)]);
                                 return -1;
                         }
-                } break;
+                } VM_BREAK;
+
+                VM_CASE(OP_TAIL_CALL) {
+                        Que_Value *value;
+
+                        arg = GET_BYTE();
+                VM_WIDE(OP_TAIL_CALL)
+                        value = sp - arg - 1;
 
-                case OP_TABLE_GET: {
-                        Que_Value *key = stack_pop(state);
-                        Que_Value *table = stack_pop(state);
-                        Que_Object *keyobj;
-                        Que_TableObject *tableobj;
+                        if (QUE_VALUE_TYPE(*value) != QUE_TYPE_FUNCTION) {
+                                /* Nothing to reuse, C functions return straight away */
+                                goto VM_WIDE_OP_CALL;
+                        }
+
+                        /* Replace the current frame with the callee */
+                        memmove(slots, value, sizeof(Que_Value) * (arg + 1));
+                        sp = slots + arg + 1;
+
+                        frame->func = (Que_FunctionObject *)QUE_AS_OBJECT(*slots);
+                        frame->ip = frame->func->code.code;
+                        LOAD_FRAME();
+                } VM_BREAK;
+
+                VM_CASE(OP_TABLE_GET) {
+                        Que_Value key;
+                        Que_Value *table;
                         Que_Value *result;
 
-                        if (key->type != QUE_TYPE_STRING) {
-                                error("Table must be indexed with identifier, not '%s'", QUE_TYPE_NAMES[key->type]);
+                        arg = GET_BYTE();
+                VM_WIDE(OP_TABLE_GET)
+                        key = GET_CONSTANT(arg);
+                        table = --sp;
+
+                        if (QUE_VALUE_TYPE(key) != QUE_TYPE_STRING) {
+                                error("Table must be indexed with identifier, not '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(key)]);
                                 return -1;
-                        } else if (table->type != QUE_TYPE_TABLE) {
-                                error("Cannot index non table objecst such as '%s'", QUE_TYPE_NAMES[table->type]);
+                        } else if (QUE_VALUE_TYPE(*table) != QUE_TYPE_TABLE) {
+                                error("Cannot index non table objecst such as '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(*table)]);
                                 return -1;
                         }
 
-                        keyobj = (Que_Object *)key->value.o;
-                        tableobj = (Que_TableObject *)table->value.o;
-
-                        result = Que_TableGet(tableobj, key);
+                        result = CACHED_GET((Que_TableObject *)QUE_AS_OBJECT(*table), arg);
                         if (!result) {
-                                Que_PushNil(state);
+                                PUSH_NIL();
                         } else {
-                                stack_push(state, result);
+                                PUSH(*result);
                         }
-                } break;
+                } VM_BREAK;
 
-                case OP_RETURN: {
+                VM_CASE(OP_RETURN) {
                         Que_Value retval;
 
-                        if (state->frame_current == state->frames) {
+                        if (frame == state->frames) {
                                 /* Halt execution */
-                                stack_pop(state);
+                                sp = slots;
+                                SAVE_FRAME();
+#ifdef QUE_DEBUG_OPCODE_PAIRS
+                                dump_opcode_pairs();
+#endif
                                 return 0;
+                        }
+
+                        /* Drop locals, arguments and the function itself */
+                        retval = POP();
+                        sp = slots;
+                        PUSH(retval);
+
+                        frame--;
+                        state->frame_current = frame;
+                        LOAD_FRAME();
+                } VM_BREAK;
+
+                VM_CASE(OP_GET_GLOBAL_FIELD) {
+                        Que_Byte global_addr = GET_BYTE();
+                        Que_Byte field_addr = GET_BYTE();
+                        GlobalSlot *global = GET_GLOBAL(global_addr);
+                        Que_Value field = GET_CONSTANT(field_addr);
+                        Que_Value *table = &global->value;
+                        Que_Value *result;
+
+                        if (!global->defined) {
+                                error("Global variable '%s' does not exist", global->name->str);
+                                return -1;
+                        } else if (QUE_VALUE_TYPE(field) != QUE_TYPE_STRING) {
+                                error("Table must be indexed with identifier, not '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(field)]);
+                                return -1;
+                        } else if (QUE_VALUE_TYPE(*table) != QUE_TYPE_TABLE) {
+                                error("Cannot index non table objecst such as '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(*table)]);
+                                return -1;
+                        }
+
+                        result = CACHED_GET((Que_TableObject *)QUE_AS_OBJECT(*table), field_addr);
+                        if (!result) {
+                                PUSH_NIL();
+                        } else {
+                                PUSH(*result);
+                        }
+                } VM_BREAK;
+
+                VM_CASE(OP_ADD_LOCALS) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+
+                        if (BOTH_TYPE(QUE_TYPE_STRING, slots[a], slots[b])) {
+                                SAVE_FRAME();
+                                QUE_SET_OBJECT(*sp, QUE_TYPE_STRING, CONCAT(slots[a], slots[b]));
+                                sp++;
                         } else {
-                                Que_Word arity = get_word(state);
-                                Que_Word i;
+                                QUICKEN(ip - 3, slots[a], slots[b], OP_ADD_LOCALS_II, OP_ADD_LOCALS_FF);
+                                ARITHMETIC(slots[a], slots[b], +, "+");
+                        }
+                } VM_BREAK;
+
+                VM_CASE(OP_ADD_LOCALS_II) {
+                        QUICK_LOCALS(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, +, OP_ADD_LOCALS);
+                } VM_BREAK;
+
+                VM_CASE(OP_ADD_LOCALS_FF) {
+                        QUICK_LOCALS(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, +, OP_ADD_LOCALS);
+                } VM_BREAK;
+
+                VM_CASE(OP_MULTIPLY_LOCALS) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+
+                        QUICKEN(ip - 3, slots[a], slots[b], OP_MULTIPLY_LOCALS_II, OP_MULTIPLY_LOCALS_FF);
+                        ARITHMETIC(slots[a], slots[b], *, "*");
+                } VM_BREAK;
+
+                VM_CASE(OP_MULTIPLY_LOCALS_II) {
+                        QUICK_LOCALS(QUE_TYPE_INT, QUE_SET_INT, QUE_AS_INT, *, OP_MULTIPLY_LOCALS);
+                } VM_BREAK;
+
+                VM_CASE(OP_MULTIPLY_LOCALS_FF) {
+                        QUICK_LOCALS(QUE_TYPE_FLOAT, QUE_SET_FLOAT, QUE_AS_FLOAT, *, OP_MULTIPLY_LOCALS);
+                } VM_BREAK;
+
+                VM_CASE(OP_WIDE) {
+                        ins = GET_BYTE();
+                        arg = GET_WORD();
+
+                        switch (ins) {
+                        case OP_PUSH: goto VM_WIDE_OP_PUSH;
+                        case OP_GET_GLOBAL: goto VM_WIDE_OP_GET_GLOBAL;
+                        case OP_TABLE_GET: goto VM_WIDE_OP_TABLE_GET;
+                        case OP_SET_LOCAL: goto VM_WIDE_OP_SET_LOCAL;
+                        case OP_GET_LOCAL: goto VM_WIDE_OP_GET_LOCAL;
+                        case OP_CALL: goto VM_WIDE_OP_CALL;
+                        case OP_TAIL_CALL: goto VM_WIDE_OP_TAIL_CALL;
+                        }
 
-                                retval = *stack_pop(state);
+                        error("Opcode %s has no wide form", OPCODE_NAMES[ins]);
+                        return -1;
+                } VM_BREAK;
+
+                VM_CASE(OP_HALT) {
+                        SAVE_FRAME();
+                        return 0;
+                } VM_BREAK;
+
+                /* Not yet implemented by the VM */
+                VM_CASE(OP_GR) VM_CASE(OP_GREQ)
+                VM_CASE(OP_LE) VM_CASE(OP_LEQ)
+                VM_CASE(OP_EQ) VM_CASE(OP_NEQ)
+                VM_CASE(OP_JUMP) VM_CASE(OP_JUMP_IF_FALSE)
+                VM_DEFAULT {
+                        error("Unknown opcode %d", ins);
+                        return -1;
+                } VM_BREAK;
+                }
+        }
+}
+
+/**
+ * vm_execute_registers runs code from ropcodes.txt, as generated by the parser
+ * in QUE_MODE_REGISTER. Registers are the slots of the current frame: the
+ * function, its arguments, its locals and then temporaries. A call runs the
+ * callee with its frame starting at the function's register, where its return
+ * value is stored. The stack top is only moved for C functions.
+ */
+#define REG(i) (slots[i])
+
+/* Whether a frame of func starting at slots fits in the stack */
+#define FRAME_FITS(func, slots) \
+        ((size_t)((slots) - state->stack) + (size_t)(func)->registers <= state->stack_size)
+
+#undef VM_FETCH
+#define VM_FETCH() (ins = GET_BYTE())
+
+int vm_execute_registers(Que_State *state) {
+        Que_Byte ins;
+
+        CallFrame *frame = state->frame_current;
+        Que_Byte *ip;
+        Que_Value *slots;
+        Que_Value *constants;
+        InlineCache *caches;
+
+#ifdef QUE_COMPUTED_GOTO
+        static void *dispatch_table[] = {
+#define RA(name) __extension__ &&VM_LABEL_##name
+#define RAB(name) __extension__ &&VM_LABEL_##name
+#define RABC(name) __extension__ &&VM_LABEL_##name
+#define RAK(name) __extension__ &&VM_LABEL_##name
+#define RABK(name) __extension__ &&VM_LABEL_##name
+#define RAG(name) __extension__ &&VM_LABEL_##name
+#include "ropcodes.txt"
+#undef RA
+#undef RAB
+#undef RABC
+#undef RAK
+#undef RABK
+#undef RAG
+        };
+#endif
+
+        if (!FRAME_FITS(frame->func, frame->slots)) {
+                error("Stack overflow calling '%s'", frame->func->name->str);
+                return -1;
+        }
 
-                                for (i = 0; i < arity; i++) {
-                                        stack_pop(state);
+        LOAD_FRAME();
+
+        for (;;) {
+                VM_FETCH();
+
+                VM_SWITCH(ins) {
+                VM_CASE(ROP_MOVE) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+
+                        REG(a) = REG(b);
+                } VM_BREAK;
+
+                VM_CASE(ROP_LOAD_CONST) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Word k = GET_WORD();
+
+                        REG(a) = GET_CONSTANT(k);
+                } VM_BREAK;
+
+                VM_CASE(ROP_LOAD_TRUE) {
+                        Que_Byte a = GET_BYTE();
+
+                        QUE_SET_BOOL(REG(a), QUE_TRUE);
+                } VM_BREAK;
+
+                VM_CASE(ROP_LOAD_FALSE) {
+                        Que_Byte a = GET_BYTE();
+
+                        QUE_SET_BOOL(REG(a), QUE_FALSE);
+                } VM_BREAK;
+
+                VM_CASE(ROP_LOAD_NIL) {
+                        Que_Byte a = GET_BYTE();
+
+                        QUE_SET_NIL(REG(a));
+                } VM_BREAK;
+
+                VM_CASE(ROP_ADD) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        if (BOTH_TYPE(QUE_TYPE_STRING, REG(b), REG(c))) {
+                                /* Registers are not covered by the stack
+                                 * top, so nothing may be collected here */
+                                frame->ip = ip;
+                                gc_pause(state);
+                                QUE_SET_OBJECT(REG(a), QUE_TYPE_STRING, CONCAT(REG(b), REG(c)));
+                                gc_resume(state);
+                        } else {
+                                ARITHMETIC_TO(REG(a), REG(b), REG(c), +, "+");
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_SUBTRACT) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        ARITHMETIC_TO(REG(a), REG(b), REG(c), -, "-");
+                } VM_BREAK;
+
+                VM_CASE(ROP_MULTIPLY) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        ARITHMETIC_TO(REG(a), REG(b), REG(c), *, "*");
+                } VM_BREAK;
+
+                VM_CASE(ROP_DIVIDE) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        CHECK_DIVISOR(REG(b), REG(c));
+                        ARITHMETIC_TO(REG(a), REG(b), REG(c), /, "/");
+                } VM_BREAK;
+
+                VM_CASE(ROP_POW) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value lhs = REG(GET_BYTE());
+                        Que_Value rhs = REG(GET_BYTE());
+
+                        if (QUE_VALUE_TYPE(lhs) == QUE_TYPE_INT && QUE_VALUE_TYPE(rhs) == QUE_TYPE_INT) {
+                                QUE_SET_INT(REG(a), powl(QUE_AS_INT(lhs), QUE_AS_INT(rhs)));
+                        } else if (IS_ARITHMETIC(lhs) && IS_ARITHMETIC(rhs)) {
+                                QUE_SET_FLOAT(REG(a), pow(AS_ARITHMETIC(lhs), AS_ARITHMETIC(rhs)));
+                        } else {
+                                error(
+                                        "Invalid operands '%s' and '%s' for operator '**'",
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(lhs)],
+                                        QUE_TYPE_NAMES[QUE_VALUE_TYPE(rhs)]
+                                );
+                                return -1;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_NEGATE) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value v = REG(GET_BYTE());
+
+                        if (QUE_VALUE_TYPE(v) == QUE_TYPE_INT) {
+                                QUE_SET_INT(REG(a), -QUE_AS_INT(v));
+                        } else if (IS_ARITHMETIC(v)) {
+                                QUE_SET_FLOAT(REG(a), -AS_ARITHMETIC(v));
+                        } else {
+                                error("Invalid operands '%s' for operator '-'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(v)]);
+                                return -1;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_BAND) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        INTEGER_ARITHMETIC_TO(REG(a), REG(b), REG(c), &, "&");
+                } VM_BREAK;
+
+                VM_CASE(ROP_BOR) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        INTEGER_ARITHMETIC_TO(REG(a), REG(b), REG(c), |, "|");
+                } VM_BREAK;
+
+                VM_CASE(ROP_BXOR) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        INTEGER_ARITHMETIC_TO(REG(a), REG(b), REG(c), ^, "^");
+                } VM_BREAK;
+
+                VM_CASE(ROP_LSHIFT) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        INTEGER_ARITHMETIC_TO(REG(a), REG(b), REG(c), <<, "<<");
+                } VM_BREAK;
+
+                VM_CASE(ROP_RSHIFT) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Byte b = GET_BYTE();
+                        Que_Byte c = GET_BYTE();
+
+                        INTEGER_ARITHMETIC_TO(REG(a), REG(b), REG(c), >>, ">>");
+                } VM_BREAK;
+
+                VM_CASE(ROP_BNOT) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value v = REG(GET_BYTE());
+
+                        if (QUE_VALUE_TYPE(v) == QUE_TYPE_INT) {
+                                QUE_SET_INT(REG(a), ~QUE_AS_INT(v));
+                        } else {
+                                error("Invalid operands '%s' for operator '~'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(v)]);
+                                return -1;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_AND) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value lhs = REG(GET_BYTE());
+                        Que_Value rhs = REG(GET_BYTE());
+
+                        QUE_SET_BOOL(REG(a), value_is_truthy(&lhs) && value_is_truthy(&rhs));
+                } VM_BREAK;
+
+                VM_CASE(ROP_OR) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value lhs = REG(GET_BYTE());
+                        Que_Value rhs = REG(GET_BYTE());
+
+                        QUE_SET_BOOL(REG(a), value_is_truthy(&lhs) || value_is_truthy(&rhs));
+                } VM_BREAK;
+
+                VM_CASE(ROP_NOT) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value v = REG(GET_BYTE());
+
+                        QUE_SET_BOOL(REG(a), !value_is_truthy(&v));
+                } VM_BREAK;
+
+                VM_CASE(ROP_GET_FIELD) {
+                        Que_Byte a = GET_BYTE();
+                        Que_Value table = REG(GET_BYTE());
+                        Que_Word k = GET_WORD();
+                        Que_Value key = GET_CONSTANT(k);
+                        Que_Value *result;
+
+                        if (QUE_VALUE_TYPE(key) != QUE_TYPE_STRING) {
+                                error("Table must be indexed with identifier, not '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(key)]);
+                                return -1;
+                        } else if (QUE_VALUE_TYPE(table) != QUE_TYPE_TABLE) {
+                                error("Cannot index non table objecst such as '%s'", QUE_TYPE_NAMES[QUE_VALUE_TYPE(table)]);
+                                return -1;
+                        }
+
+                        result = CACHED_GET((Que_TableObject *)QUE_AS_OBJECT(table), k);
+                        if (!result) {
+                                QUE_SET_NIL(REG(a));
+                        } else {
+                                REG(a) = *result;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_DEFINE_GLOBAL) {
+                        Que_Byte a = GET_BYTE();
+                        GlobalSlot *global = GET_GLOBAL(GET_WORD());
+
+                        global->value = REG(a);
+                        global->defined = QUE_TRUE;
+                        GC_BARRIER(state, &global->value);
+                } VM_BREAK;
+
+                VM_CASE(ROP_SET_GLOBAL) {
+                        Que_Byte a = GET_BYTE();
+                        GlobalSlot *global = GET_GLOBAL(GET_WORD());
+
+                        assert(global->defined && "Attempt to set nonexistent global");
+                        global->value = REG(a);
+                        global->defined = QUE_TRUE;
+                        GC_BARRIER(state, &global->value);
+                } VM_BREAK;
+
+                VM_CASE(ROP_GET_GLOBAL) {
+                        Que_Byte a = GET_BYTE();
+                        GlobalSlot *global = GET_GLOBAL(GET_WORD());
+
+                        if (global->defined) {
+                                REG(a) = global->value;
+                        } else {
+                                error("Global variable '%s' does not exist", global->name->str);
+                                return -1;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_CALL) {
+                        Que_Byte a;
+                        Que_Byte args;
+                        Que_Value *value;
+
+                do_call:
+                        a = GET_BYTE();
+                        args = GET_BYTE();
+                        value = &REG(a);
+
+                        if (QUE_VALUE_TYPE(*value) == QUE_TYPE_CFUNCTION) {
+                                int ret;
+                                Que_CFunction cfunc = QUE_AS_CFUNCTION(*value);
+
+                                /* C functions work on the state's stack */
+                                frame->ip = ip;
+                                state->stack_top = value + args + 1;
+                                ret = cfunc(state, args);
+
+                                if (ret != 0) {
+                                        Que_Value errorstr = state->stack_top[-2];
+                                        error("%s", string_flatten(state, (Que_StringObject *)QUE_AS_OBJECT(errorstr))->str);
+
+                                        return ret;
                                 }
 
-                                stack_pop(state); /* Calling function */
+                                *value = state->stack_top[-1];
+                        } else if (QUE_VALUE_TYPE(*value) == QUE_TYPE_FUNCTION) {
+                                Que_FunctionObject *func = (Que_FunctionObject *)QUE_AS_OBJECT(*value);
+                                assert(func->ob_head.type == QUE_TYPE_FUNCTION);
+
+                                if (frame + 1 == state->frames + state->max_recursion || !FRAME_FITS(func, value)) {
+                                        error("Stack overflow calling '%s'", func->name->str);
+                                        return -1;
+                                }
 
-                                stack_push(state, &retval);
+                                frame->ip = ip;
+                                frame++;
+                                frame->func = func;
+                                frame->ip = func->code.code;
+                                frame->slots = value;
+                                state->frame_current = frame;
+                                LOAD_FRAME();
+                        } else {
+                                error("Object type '%s' is not a function", QUE_TYPE_NAMES[QUE_VALUE_TYPE(*value)]);
+                                return -1;
+                        }
+                } VM_BREAK;
+
+                VM_CASE(ROP_TAIL_CALL) {
+                        Que_Byte a = ip[0];
+                        Que_Byte args = ip[1];
+
+                        if (QUE_VALUE_TYPE(REG(a)) != QUE_TYPE_FUNCTION) {
+                                goto do_call;
                         }
 
+                        /* The callee may need more registers than the caller */
+                        if (!FRAME_FITS((Que_FunctionObject *)QUE_AS_OBJECT(REG(a)), slots)) {
+                                goto do_call;
+                        }
 
-                        /* *state->frame_current->slots = *(state->stack_top); */
+                        /* Replace the current frame with the callee */
+                        memmove(slots, &REG(a), sizeof(Que_Value) * (args + 1));
 
-                        state->frame_current--;
-                } break;
+                        frame->func = (Que_FunctionObject *)QUE_AS_OBJECT(REG(0));
+                        frame->ip = frame->func->code.code;
+                        LOAD_FRAME();
+                } VM_BREAK;
 
-                case OP_HALT: {
-                        return 0;
-                } break;
+                VM_CASE(ROP_RETURN) {
+                        Que_Byte a = GET_BYTE();
+
+                        if (frame == state->frames) {
+                                /* Halt execution */
+                                frame->ip = ip;
+                                state->stack_top = slots;
+                                return 0;
+                        }
+
+                        /* The function's own slot is the caller's result register */
+                        REG(0) = REG(a);
+
+                        frame--;
+                        state->frame_current = frame;
+                        LOAD_FRAME();
+                } VM_BREAK;
 
-                default: {
+                /* Not yet implemented by the VM */
+                VM_CASE(ROP_GR) VM_CASE(ROP_GREQ)
+                VM_CASE(ROP_LE) VM_CASE(ROP_LEQ)
+                VM_CASE(ROP_EQ) VM_CASE(ROP_NEQ)
+                VM_DEFAULT {
                         error("Unknown opcode %d", ins);
                         return -1;
-                } break;
+                } VM_BREAK;
                 }
         }
 }
@@ -5,4 +5,9 @@
 
 int vm_execute(Que_State *state);
 
+/**
+ * Runs code compiled for QUE_MODE_REGISTER, see ropcodes.txt.
+ */
+int vm_execute_registers(Que_State *state);
+
 #endif /* QUE_VM_H */
@@ -0,0 +1,47 @@
+/**
+ * Checks that dividing an int by 0 is a runtime error in both interpreters
+ * rather than a crash (see `make check`), also once the division has been
+ * specialised for ints, and that the state can run scripts again afterwards.
+ */
+#include <stdio.h>
+
+#include <que/state.h>
+
+static const char *DIVIDE =
+        "function div(a, b):\n"
+        "    return a / b\n"
+        "\n"
+        "let x = div(7, 2) + div(9, 3)\n"
+        "let y = div(7.0, 0.0)\n";
+
+static const char *BY_ZERO = "let z = div(7, 0)\n";
+
+static int test(const char *name, Que_ExecutionMode mode) {
+        Que_State *state = Que_NewState();
+        int ret;
+
+        Que_SetExecutionMode(state, mode);
+
+        if ((ret = Que_ExecuteString(state, DIVIDE)) != 0) {
+                fprintf(stderr, "division: %s: dividing returned %d\n", name, ret);
+                return 0;
+        } else if ((ret = Que_ExecuteString(state, BY_ZERO)) != QUE_ERROR_RUNTIME) {
+                fprintf(stderr, "division: %s: dividing by 0 returned %d, expected %d\n",
+                        name, ret, QUE_ERROR_RUNTIME);
+                return 0;
+        } else if ((ret = Que_ExecuteString(state, "let w = div(8, 4)\n")) != 0) {
+                fprintf(stderr, "division: %s: dividing afterwards returned %d\n", name, ret);
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+int main(void) {
+        if (!test("stack", QUE_MODE_STACK) || !test("register", QUE_MODE_REGISTER)) {
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,233 @@
+/**
+ * Checks that a collection step stays about as small as the step size asks
+ * for (see `make check`), in two cases that used to finish a lot of marking
+ * at once:
+ *
+ * - A large table that only the stack refers to is put there after the
+ *   collection has started, so the collector only finds it when it marks the
+ *   stack again at the end of the marking phase.
+ * - Keys are added to a large table while the collector is scanning it, which
+ *   grows its hash part and finally moves its keys to the array part.
+ *
+ * Each step may mark no more objects than its budget allows, and everything
+ * in the tables must survive the collection.
+ */
+#include <stdio.h>
+
+#include <que/state.h>
+#include <que/table.h>
+
+#include "../src/gc.h"
+#include "../src/state_internal.h"
+
+#define STEP_SIZE 64
+#define TABLES 20000
+
+/* Keys added to the table being scanned before each step */
+#define ADDED_PER_STEP 32
+
+/* What one step may mark: every unit of work marks at most one object, and
+ * marking the stack again marks what it holds */
+#define MAX_MARKED (STEP_SIZE * 2 + 16)
+
+static void push_table(Que_State *state, Que_TableObject *table) {
+        Que_Value value;
+
+        Que_ValueTable(&value, table);
+        *state->stack_top++ = value;
+}
+
+/* Stores a new table holding i under key i */
+static void add_leaf(Que_State *state, Que_TableObject *tree, int i) {
+        Que_TableObject *leaf = Que_NewTable(state);
+        Que_Value key, value;
+
+        Que_ValueTable(&value, leaf);
+        *state->stack_top++ = value;
+
+        Que_ValueInt(&key, 0);
+        Que_ValueInt(&value, i);
+        Que_TableInsert(leaf, &key, &value);
+
+        Que_ValueInt(&key, i);
+        Que_ValueTable(&value, leaf);
+        Que_TableInsert(tree, &key, &value);
+
+        state->stack_top--;
+}
+
+/* A table of TABLES leaves, under keys first and up */
+static Que_TableObject *make_tree(Que_State *state, int first) {
+        Que_TableObject *tree = Que_NewTable(state);
+        int i;
+
+        push_table(state, tree);
+        for (i = first; i < first + TABLES; i++) {
+                add_leaf(state, tree, i);
+        }
+
+        state->stack_top--;
+        return tree;
+}
+
+/* Whether tree still has the leaves under keys first to last */
+static int check_tree(Que_TableObject *tree, int first, int last) {
+        Que_Value key, *leaf, *index;
+        int i;
+
+        for (i = first; i <= last; i++) {
+                Que_ValueInt(&key, i);
+                leaf = Que_TableGet(tree, &key);
+                if (!leaf || QUE_VALUE_TYPE(*leaf) != QUE_TYPE_TABLE) {
+                        fprintf(stderr, "gc_pause: table %d did not survive\n", i);
+                        return 0;
+                }
+
+                Que_ValueInt(&key, 0);
+                index = Que_TableGet((Que_TableObject *)QUE_AS_OBJECT(*leaf), &key);
+                if (!index || QUE_AS_INT(*index) != i) {
+                        fprintf(stderr, "gc_pause: table %d did not survive\n", i);
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static size_t count_marked(Que_State *state) {
+        Que_Object *obj;
+        size_t count = 0;
+
+        for (obj = state->objects; obj; obj = obj->next) {
+                count += obj->marked == state->gc_mark;
+        }
+
+        return count;
+}
+
+/* Does one step and returns how many objects it marked */
+static size_t step(Que_State *state) {
+        size_t before = count_marked(state);
+
+        gc_step(state);
+        return count_marked(state) - before;
+}
+
+static int check_bound(const char *name, size_t max_marked) {
+        if (max_marked > MAX_MARKED) {
+                fprintf(stderr, "gc_pause: %s: a step marked %lu objects, expected at most %d\n",
+                        name, (unsigned long)max_marked, MAX_MARKED);
+                return 0;
+        }
+
+        return 1;
+}
+
+static int test_stack(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *tree;
+        size_t max_marked = 0;
+
+        Que_SetGCStepSize(state, STEP_SIZE);
+
+        /* Keeps the marking phase going for a while */
+        push_table(state, make_tree(state, 0));
+
+        tree = make_tree(state, 0);
+        push_table(state, tree);
+        gc_collect(state);
+
+        /* Nothing else refers to tree until the collection has started */
+        state->stack_top--;
+        gc_step(state);
+        if (state->gc_phase != GC_PHASE_MARK) {
+                fprintf(stderr, "gc_pause: marking ended in the first step\n");
+                return 0;
+        }
+
+        push_table(state, tree);
+        while (state->gc_phase == GC_PHASE_MARK) {
+                size_t marked = step(state);
+
+                if (marked > max_marked) {
+                        max_marked = marked;
+                }
+        }
+
+        while (state->gc_phase != GC_PHASE_IDLE) {
+                gc_step(state);
+        }
+
+        if (!check_bound("stack", max_marked) || !check_tree(tree, 0, TABLES - 1)) {
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+static int test_growing(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *tree;
+        size_t max_marked = 0;
+        int added = 0;
+        int extended = 0;
+        int i;
+
+        Que_SetGCStepSize(state, STEP_SIZE);
+
+        /* Key 0 is missing, so the keys wait in the hash part */
+        tree = make_tree(state, 1);
+        push_table(state, tree);
+        gc_collect(state);
+
+        gc_step(state);
+        while (state->gc_phase == GC_PHASE_MARK) {
+                size_t marked;
+
+                /* Steps only run where they are measured */
+                gc_pause(state);
+                if (state->gc_cursor.table == tree) {
+                        for (i = 0; i < ADDED_PER_STEP; i++) {
+                                added++;
+                                add_leaf(state, tree, TABLES + added);
+                        }
+
+                        /* Once the hash part has grown, move it all */
+                        if (!extended && added > TABLES / 4) {
+                                add_leaf(state, tree, 0);
+                                extended = 1;
+                        }
+                }
+                gc_resume(state);
+
+                marked = step(state);
+                if (marked > max_marked) {
+                        max_marked = marked;
+                }
+        }
+
+        while (state->gc_phase != GC_PHASE_IDLE) {
+                gc_step(state);
+        }
+
+        if (!check_bound("growing", max_marked)) {
+                return 0;
+        } else if (!extended) {
+                fprintf(stderr, "gc_pause: growing: the table was scanned before its keys moved\n");
+                return 0;
+        } else if (!check_tree(tree, 0, TABLES + added)) {
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+int main(void) {
+        if (!test_stack() || !test_growing()) {
+                return 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * Checks the memory limit (see `make check`). A script that keeps growing a
+ * string must be abandoned with QUE_ERROR_MEMORY without the state passing
+ * its limit, and the state must then run a script that needs most of the
+ * memory the first one left behind, which only fits once the collector has
+ * freed it. A few rounds of both make sure nothing is left over each time.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <que/state.h>
+
+#define LIMIT (1024 * 1024)
+#define ROUNDS 3
+
+/* Pieces added to the string by GROW_SOME, several hundred KB in all */
+#define PIECES 6000
+
+#define PIECE "    s = s + \"abcdefghijklmnop\"\n"
+#define HEAD "function fill(s):\n"
+#define TAIL "    return s\n\nfill(\"\")\n"
+
+/* Tail calls keep the stack from growing, so only the string does. It only
+ * lives on the stack, so it is garbage once the script is abandoned */
+static const char *GROW_FOREVER =
+        "function fill(s):\n"
+        "    return fill(s + \"abcdefghijklmnop\")\n"
+        "\n"
+        "fill(\"\")\n";
+
+/* There are no loops yet, so this writes out every step */
+static char GROW_SOME[sizeof(HEAD) + PIECES * (sizeof(PIECE) - 1) + sizeof(TAIL)];
+
+static void make_grow_some(void) {
+        char *end = GROW_SOME;
+        int i;
+
+        strcpy(end, HEAD);
+        end += strlen(end);
+        for (i = 0; i < PIECES; i++) {
+                strcpy(end, PIECE);
+                end += strlen(end);
+        }
+
+        strcpy(end, TAIL);
+}
+
+int main(void) {
+        Que_State *state = Que_NewState();
+        int round;
+        int ret;
+
+        make_grow_some();
+        Que_SetMemoryLimit(state, LIMIT);
+
+        for (round = 0; round < ROUNDS; round++) {
+                ret = Que_ExecuteString(state, GROW_FOREVER);
+                if (ret != QUE_ERROR_MEMORY) {
+                        fprintf(stderr, "memory_limit: round %d: growing forever returned %d, expected %d\n",
+                                round, ret, QUE_ERROR_MEMORY);
+                        return 1;
+                } else if (Que_GetMemoryUsage(state) > LIMIT) {
+                        fprintf(stderr, "memory_limit: round %d: %lu bytes in use, over the limit\n",
+                                round, (unsigned long)Que_GetMemoryUsage(state));
+                        return 1;
+                }
+
+                ret = Que_ExecuteString(state, GROW_SOME);
+                if (ret != 0) {
+                        fprintf(stderr, "memory_limit: round %d: the script after the failure returned %d\n",
+                                round, ret);
+                        return 1;
+                }
+        }
+
+        Que_DeleteState(state);
+        return 0;
+}
@@ -0,0 +1,66 @@
+/**
+ * Checks that register mode reports running out of stack or call frames as
+ * a runtime error instead of writing past them (see `make check`), and that
+ * the state can run scripts again afterwards.
+ */
+#include <stdio.h>
+
+#include <que/state.h>
+
+static const char *RECURSE =
+        "function f(x):\n"
+        "    return 1 + f(x)\n"
+        "\n"
+        "f(1)\n";
+
+static const char *WIDE =
+        "function g(a, b, c):\n"
+        "    return a * (b + (c * (a + (b * (c + (a * b))))))\n"
+        "\n"
+        "let r = g(1, 2, 3)\n";
+
+static int expect(Que_State *state, const char *name, const char *script, int status) {
+        int ret = Que_ExecuteString(state, script);
+
+        if (ret != status) {
+                fprintf(stderr, "register_stack: %s returned %d, expected %d\n", name, ret, status);
+                return 0;
+        }
+
+        return 1;
+}
+
+/* Runs out of stack before call frames when stack_size is small */
+static int test(const char *name, size_t stack_size, size_t max_recursion) {
+        Que_State *state = Que_NewStateEx(stack_size, max_recursion);
+        int ok;
+
+        Que_SetExecutionMode(state, QUE_MODE_REGISTER);
+        ok = expect(state, name, RECURSE, QUE_ERROR_RUNTIME) &&
+             expect(state, name, WIDE, 0);
+
+        Que_DeleteState(state);
+        return ok;
+}
+
+int main(void) {
+        if (!test("stack", 64, 1024) || !test("frames", 256 * 256, 64)) {
+                return 1;
+        }
+
+        /* Even the script itself does not fit */
+        {
+                Que_State *state = Que_NewStateEx(2, 16);
+                int ok;
+
+                Que_SetExecutionMode(state, QUE_MODE_REGISTER);
+                ok = expect(state, "script", WIDE, QUE_ERROR_RUNTIME);
+                Que_DeleteState(state);
+
+                if (!ok) {
+                        return 1;
+                }
+        }
+
+        return 0;
+}
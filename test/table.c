@@ -0,0 +1,476 @@
+/**
+ * Checks the parts of a table against each other (see `make check`):
+ *
+ * - The hash part growing, with every key found again after each resize.
+ * - Keys moving from the hash part to the array part once the key before
+ *   them arrives, which takes them out of the hash part with a backward
+ *   shift that must leave the keys still there findable.
+ * - String keys moving from a shape to the hash part once a table has more
+ *   than SHAPE_MAX_FIELDS of them.
+ * - Cursors walking a table while its values are overwritten, which must
+ *   visit every entry once, and while keys are added, which must not read
+ *   past the table.
+ * - Ropes used as keys, which must find the same entry as the flat string
+ *   with their characters.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <que/state.h>
+#include <que/table.h>
+
+#include "../src/state_internal.h"
+
+#define RESIZE_KEYS 1000
+
+/* Keys 1 to SHIFT_KEYS go in the hash part, except SHIFT_GAP */
+#define SHIFT_KEYS 200
+#define SHIFT_GAP 100
+
+#define MANY_STRINGS (SHAPE_MAX_FIELDS + 8)
+
+/* Joined onto "rope" this many times, deeper than a rope is ever left */
+#define ROPE_PIECES 40
+#define ROPE_PIECE "-abcdefghij"
+
+static Que_TableObject *new_table(Que_State *state) {
+        Que_TableObject *table = Que_NewTable(state);
+        Que_Value value;
+
+        /* Keeps the table alive until the state is deleted */
+        Que_ValueTable(&value, table);
+        *state->stack_top++ = value;
+        return table;
+}
+
+static void string_key(Que_State *state, Que_Value *key, int i) {
+        char name[16];
+
+        sprintf(name, "k%d", i);
+        Que_ValueString(state, key, name, strlen(name));
+}
+
+static void insert_int(Que_TableObject *table, Que_Int key, Que_Int value) {
+        Que_Value k, v;
+
+        Que_ValueInt(&k, key);
+        Que_ValueInt(&v, value);
+        Que_TableInsert(table, &k, &v);
+}
+
+static void insert_string(Que_TableObject *table, int key, Que_Int value) {
+        Que_Value k, v;
+
+        string_key(table->state, &k, key);
+        Que_ValueInt(&v, value);
+        Que_TableInsert(table, &k, &v);
+}
+
+static int check(const char *name, Que_TableObject *table, Que_Value *key, Que_Int expected) {
+        Que_Value *found = Que_TableGet(table, key);
+
+        if (!found || QUE_VALUE_TYPE(*found) != QUE_TYPE_INT || QUE_AS_INT(*found) != expected) {
+                fprintf(stderr, "table: %s: a key did not map to %ld\n", name, (long)expected);
+                return 0;
+        }
+
+        return 1;
+}
+
+static int check_int(const char *name, Que_TableObject *table, Que_Int key, Que_Int expected) {
+        Que_Value k;
+
+        Que_ValueInt(&k, key);
+        return check(name, table, &k, expected);
+}
+
+static int check_string(const char *name, Que_TableObject *table, int key, Que_Int expected) {
+        Que_Value k;
+
+        string_key(table->state, &k, key);
+        return check(name, table, &k, expected);
+}
+
+static int check_missing(const char *name, Que_TableObject *table, Que_Value *key) {
+        if (Que_TableGet(table, key)) {
+                fprintf(stderr, "table: %s: found a key that was never inserted\n", name);
+                return 0;
+        }
+
+        return 1;
+}
+
+static int test_resize(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *table = new_table(state);
+        Que_Value key;
+        size_t capacity = 0;
+        int resizes = 0;
+        int i, j;
+
+        for (i = 1; i <= RESIZE_KEYS; i++) {
+                insert_int(table, -i, i);
+
+                if (table->capacity != capacity) {
+                        capacity = table->capacity;
+                        resizes++;
+
+                        for (j = 1; j <= i; j++) {
+                                if (!check_int("resize", table, -j, j)) {
+                                        return 0;
+                                }
+                        }
+                }
+        }
+
+        Que_ValueInt(&key, -(RESIZE_KEYS + 1));
+        if (table->count != RESIZE_KEYS || resizes < 4 || !check_missing("resize", table, &key)) {
+                fprintf(stderr, "table: resize: %lu keys in %lu slots after %d resizes\n",
+                        (unsigned long)table->count, (unsigned long)table->capacity, resizes);
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+/* Whether every key inserted by test_shift up to now maps to its value */
+static int check_shift(Que_TableObject *table) {
+        int i;
+
+        for (i = 0; i <= SHIFT_KEYS; i++) {
+                if ((i != SHIFT_GAP || table->array_size > SHIFT_GAP) && !check_int("shift", table, i, i * 10)) {
+                        return 0;
+                } else if (i > 0 && !check_int("shift", table, -i, i)) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static int test_shift(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *table = new_table(state);
+        int i;
+
+        /* The keys that stay in the hash part share clusters with the ones
+         * that leave it */
+        for (i = SHIFT_KEYS; i > 0; i--) {
+                if (i != SHIFT_GAP) {
+                        insert_int(table, i, i * 10);
+                }
+
+                insert_int(table, -i, i);
+        }
+
+        insert_int(table, 0, 0);
+        if (table->array_size != SHIFT_GAP || table->count != SHIFT_KEYS * 2 - SHIFT_GAP ||
+            !check_shift(table)) {
+                fprintf(stderr, "table: shift: %lu keys in the array part, %lu in the hash part\n",
+                        (unsigned long)table->array_size, (unsigned long)table->count);
+                return 0;
+        }
+
+        insert_int(table, SHIFT_GAP, SHIFT_GAP * 10);
+        if (table->array_size != SHIFT_KEYS + 1 || table->count != SHIFT_KEYS || !check_shift(table)) {
+                fprintf(stderr, "table: shift: %lu keys in the array part, %lu in the hash part\n",
+                        (unsigned long)table->array_size, (unsigned long)table->count);
+                return 0;
+        }
+
+        /* Keys waiting unhashed move the same way */
+        table = new_table(state);
+        insert_int(table, 3, 30);
+        insert_int(table, 1, 10);
+        insert_int(table, 2, 20);
+        insert_int(table, 0, 0);
+        if (table->array_size != 4 || table->count != 0 || table->capacity != 0 ||
+            !check_int("shift", table, 3, 30)) {
+                fprintf(stderr, "table: shift: unhashed keys did not move to the array part\n");
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+static int test_shape(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *full = new_table(state);
+        Que_TableObject *over = new_table(state);
+        Que_TableObject *many = new_table(state);
+        Que_Value *keys;
+        Que_Value values[MANY_STRINGS];
+        Que_Value key;
+        int i;
+
+        for (i = 0; i < SHAPE_MAX_FIELDS; i++) {
+                insert_string(full, i, i);
+                insert_string(over, i, i);
+        }
+
+        if (!full->shape || full->shape != over->shape) {
+                fprintf(stderr, "table: shape: tables with the same keys do not share a shape\n");
+                return 0;
+        }
+
+        insert_string(over, SHAPE_MAX_FIELDS, SHAPE_MAX_FIELDS);
+        if (over->shape || over->count != SHAPE_MAX_FIELDS + 1 || !full->shape) {
+                fprintf(stderr, "table: shape: a table outgrowing its shape kept it\n");
+                return 0;
+        }
+
+        insert_string(over, 5, 500);
+        for (i = 0; i <= SHAPE_MAX_FIELDS; i++) {
+                if (!check_string("shape", over, i, (i == 5) ? 500 : i)) {
+                        return 0;
+                }
+        }
+
+        for (i = 0; i < SHAPE_MAX_FIELDS; i++) {
+                if (!check_string("shape", full, i, i)) {
+                        return 0;
+                }
+        }
+
+        string_key(state, &key, SHAPE_MAX_FIELDS);
+        if (!check_missing("shape", full, &key)) {
+                return 0;
+        }
+
+        /* Skips the shapes instead, the keys stay on the stack meanwhile */
+        keys = state->stack_top;
+        for (i = 0; i < MANY_STRINGS; i++) {
+                string_key(state, &key, i);
+                *state->stack_top++ = key;
+                Que_ValueInt(&values[i], i);
+        }
+
+        Que_TableInsertMany(many, keys, values, MANY_STRINGS);
+        state->stack_top = keys;
+
+        if (many->shape || many->count != MANY_STRINGS) {
+                fprintf(stderr, "table: shape: inserting many string keys kept the shape\n");
+                return 0;
+        }
+
+        for (i = 0; i < MANY_STRINGS; i++) {
+                if (!check_string("shape", many, i, i)) {
+                        return 0;
+                }
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+/* A table with every part in use, whose values are 0 to *count - 1 */
+static Que_TableObject *mixed_table(Que_State *state, int hashed, int *count) {
+        Que_TableObject *table = new_table(state);
+        int id = 0;
+        int i;
+
+        for (i = 0; i < 10; i++) {
+                insert_int(table, i, id++);
+        }
+
+        for (i = 0; i < 4; i++) {
+                insert_string(table, i, id++);
+        }
+
+        for (i = 1; i <= hashed; i++) {
+                insert_int(table, -i, id++);
+        }
+
+        *count = id;
+        return table;
+}
+
+/* Overwrites each value as it is visited, which keeps the cursor valid */
+static int walk_overwriting(const char *name, Que_TableObject *table, int count) {
+        Que_TableCursor cursor;
+        Que_Value key, value;
+        char seen[64];
+        int i;
+
+        memset(seen, 0, sizeof(seen));
+
+        Que_TableIterate(table, &cursor);
+        while (Que_TableNext(&cursor, &key, &value)) {
+                Que_Int id = QUE_AS_INT(value);
+
+                if (id < 0 || id >= count || seen[id]) {
+                        fprintf(stderr, "table: %s: the cursor visited %ld again\n", name, (long)id);
+                        return 0;
+                }
+
+                seen[id] = 1;
+                Que_ValueInt(&value, id + 100);
+                Que_TableInsert(table, &key, &value);
+        }
+
+        for (i = 0; i < count; i++) {
+                if (!seen[i]) {
+                        fprintf(stderr, "table: %s: the cursor missed %d\n", name, i);
+                        return 0;
+                }
+        }
+
+        Que_TableIterate(table, &cursor);
+        while (Que_TableNext(&cursor, &key, &value)) {
+                if (!check(name, table, &key, QUE_AS_INT(value)) || QUE_AS_INT(value) < 100) {
+                        fprintf(stderr, "table: %s: a value was not overwritten\n", name);
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+/* Adds keys once the cursor has visited after entries, which invalidates it,
+ * and checks that it still stops without going past the table */
+static int walk_adding(const char *name, Que_TableObject *table, int after, int count) {
+        Que_TableCursor cursor;
+        Que_Value key, value;
+        int visited = 0;
+        int added = 0;
+
+        Que_TableIterate(table, &cursor);
+        while (Que_TableNext(&cursor, &key, &value)) {
+                if (++visited == after) {
+                        int i;
+
+                        for (i = 0; i < SHAPE_MAX_FIELDS; i++) {
+                                insert_string(table, 100 + i, count + i);
+                                insert_int(table, -100 - i, count + SHAPE_MAX_FIELDS + i);
+                        }
+
+                        added = 1;
+                }
+
+                /* The parts after it may hold every key by now */
+                if (visited > after + count + SHAPE_MAX_FIELDS * 2) {
+                        fprintf(stderr, "table: %s: the cursor did not stop\n", name);
+                        return 0;
+                }
+        }
+
+        if (!added) {
+                fprintf(stderr, "table: %s: the cursor stopped after %d entries\n", name, visited);
+                return 0;
+        }
+
+        return 1;
+}
+
+/* Walks a table made by mixed_table, adding keys after the given number of
+ * entries if after is not 0. Cursors walk the 10 array keys first, then the
+ * 4 fields, then the hash part */
+static int walk(Que_State *state, const char *name, int hashed, int after) {
+        int count;
+        Que_TableObject *table = mixed_table(state, hashed, &count);
+
+        if (after == 0) {
+                return walk_overwriting(name, table, count);
+        }
+
+        return walk_adding(name, table, after, count);
+}
+
+static int test_iterate(void) {
+        Que_State *state = Que_NewState();
+
+        if (!walk(state, "iterate hashed", 20, 0) || !walk(state, "iterate unhashed", 3, 0) ||
+            !walk(state, "iterate fields", 3, 12) || !walk(state, "iterate unhashed", 3, 15) ||
+            !walk(state, "iterate hashed", 20, 20)) {
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+/* Joins the pieces onto "rope" one at a time. The rope and each piece stay on
+ * the stack */
+static void rope_key(Que_State *state, Que_Value *key) {
+        Que_Value piece;
+        int i;
+
+        Que_ValueString(state, key, "rope", 4);
+        *state->stack_top++ = *key;
+
+        for (i = 0; i < ROPE_PIECES; i++) {
+                Que_StringObject *rope;
+
+                Que_ValueString(state, &piece, ROPE_PIECE, strlen(ROPE_PIECE));
+                *state->stack_top++ = piece;
+
+                rope = string_concat(state, (Que_StringObject *)QUE_AS_OBJECT(*key),
+                                     (Que_StringObject *)QUE_AS_OBJECT(piece));
+                QUE_SET_OBJECT(*key, QUE_TYPE_STRING, rope);
+                state->stack_top[-2] = *key;
+                state->stack_top--;
+        }
+}
+
+/* The same characters as rope_key, in one string */
+static void flat_key(Que_State *state, Que_Value *key) {
+        char str[4 + ROPE_PIECES * sizeof(ROPE_PIECE)];
+        int i;
+
+        strcpy(str, "rope");
+        for (i = 0; i < ROPE_PIECES; i++) {
+                strcat(str, ROPE_PIECE);
+        }
+
+        Que_ValueString(state, key, str, strlen(str));
+        *state->stack_top++ = *key;
+}
+
+static int test_rope_key(void) {
+        Que_State *state = Que_NewState();
+        Que_TableObject *fields = new_table(state);
+        Que_TableObject *hashed = new_table(state);
+        Que_Value rope, other, flat, value;
+        int i;
+
+        rope_key(state, &rope);
+        rope_key(state, &other);
+        flat_key(state, &flat);
+
+        /* A rope key becomes a field like any other string */
+        Que_ValueInt(&value, 1);
+        Que_TableInsert(fields, &rope, &value);
+        if (!fields->shape || !check("rope key", fields, &flat, 1) || !check("rope key", fields, &other, 1)) {
+                return 0;
+        }
+
+        for (i = 0; i <= SHAPE_MAX_FIELDS; i++) {
+                insert_string(hashed, i, i);
+        }
+
+        Que_ValueInt(&value, 2);
+        Que_TableInsert(hashed, &flat, &value);
+        if (hashed->shape || !check("rope key", hashed, &rope, 2)) {
+                return 0;
+        }
+
+        Que_ValueInt(&value, 3);
+        Que_TableInsert(hashed, &other, &value);
+        if (hashed->count != SHAPE_MAX_FIELDS + 2 || !check("rope key", hashed, &flat, 3)) {
+                fprintf(stderr, "table: rope key: a rope was added next to the same flat key\n");
+                return 0;
+        }
+
+        Que_DeleteState(state);
+        return 1;
+}
+
+int main(void) {
+        if (!test_resize() || !test_shift() || !test_shape() || !test_iterate() || !test_rope_key()) {
+                return 1;
+        }
+
+        return 0;
+}